@@ -11,7 +11,9 @@ extern "C" {
 enum msck_session_type_e {
     MSCK_SESSION_TYPE_STREAM,
     MSCK_SESSION_TYPE_STREAM_SERVER,
-    MSCK_SESSION_TYPE_DATAGRAM
+    MSCK_SESSION_TYPE_DATAGRAM,
+    MSCK_SESSION_TYPE_TLS_STREAM,
+    MSCK_SESSION_TYPE_TLS_STREAM_SERVER
 };
 typedef enum msck_session_type_e msck_session_type_t;
 
@@ -42,14 +44,28 @@ enum msck_error_e {
     MSCK_ERROR_MAX_SESSION, /* FIXME: Rename? */
     MSCK_ERROR_BACKEND,
     MSCK_ERROR_NAME_LOOKUP,
+    MSCK_ERROR_TLS,
 };
 
 typedef enum msck_error_e msck_error_t;
 
+enum msck_tls_flag_e {
+    MSCK_TLS_VERIFY_PEER = 1,
+    MSCK_TLS_DISABLE_KTLS = 2 /* Always use user-space record crypto */
+};
+typedef enum msck_tls_flag_e msck_tls_flag_t;
+
 
 typedef struct msck_ctx_s msck_ctx_t;
 typedef struct msck_session_s msck_session_t;
 
+struct msck_ctx_stats_s {
+    uint64_t budget_read_hits; /* Sessions throttled by max_reads */
+    uint64_t budget_byte_hits; /* Sessions throttled by max_bytes */
+    uint64_t budget_resumes; /* Throttled sessions resumed next iteration */
+};
+typedef struct msck_ctx_stats_s msck_ctx_stats_t;
+
 typedef void (*msck_ctx_callback_t)(msck_ctx_t* ctx,
                                     msck_event_t type,
                                     msck_error_t err,
@@ -59,6 +75,35 @@ typedef void (*msck_ctx_callback_t)(msck_ctx_t* ctx,
 int msck_ctx_create_default(msck_ctx_callback_t cb, uintptr_t data, msck_ctx_t** out_ctx);
 void msck_ctx_destroy(msck_ctx_t* ctx);
 void msck_ctx_step(msck_ctx_t* ctx, int waitok);
+/* Returns MSCK error; out_pending is nonzero while the context still has
+ * active sessions or requests, out_events counts dispatched callbacks */
+int msck_ctx_step_ex(msck_ctx_t* ctx, int waitok,
+                     int* out_pending, int* out_events);
+/* With waitok, spin up to budget_us without blocking first (0: off) */
+int msck_ctx_set_busy_poll(msck_ctx_t* ctx, uint32_t budget_us);
+
+/* Embedding in a foreign loop: poll backend_fd for readability with
+ * backend_timeout (msec, -1: infinite), then step with waitok = 0.
+ * backend_fd is -1 where unsupported. backend_timeout is 0 while
+ * sessions throttled by the read budget wait for the next step. */
+int msck_ctx_backend_fd(msck_ctx_t* ctx);
+int msck_ctx_backend_timeout(msck_ctx_t* ctx);
+
+/* Per-session read budget for each loop iteration (0: unlimited). A
+ * session over budget stops reading until the next iteration, so other
+ * sessions get their turn first. */
+int msck_ctx_set_read_budget(msck_ctx_t* ctx,
+                             uint32_t max_reads, size_t max_bytes);
+int msck_ctx_get_stats(msck_ctx_t* ctx, msck_ctx_stats_t* out_stats);
+
+/* TLS sessions: certfile/keyfile (PEM) are required for TLS_STREAM_SERVER.
+ * TLS_STREAM sessions report CREATE_RESULT after the handshake; accepted
+ * TLS sessions too. With MSCK_TLS_VERIFY_PEER the peer certificate must
+ * also match the session name: a DNS host name, or the address for
+ * IPV4/IPV6 names and numeric DNS names. */
+int msck_ctx_tls_config(msck_ctx_t* ctx,
+                        const char* certfile, const char* keyfile,
+                        const char* cafile, int flags);
 
 int msck_session_create(msck_ctx_t* ctx,
                         msck_session_type_t st,
@@ -69,6 +114,8 @@ int msck_session_create(msck_ctx_t* ctx,
                         msck_session_t** out_session);
 void msck_session_destroy(msck_ctx_t* ctx, msck_session_t* session);
 
+/* If no session could be allocated (e.g. MSCK_ERROR_MAX_SESSION), the
+ * pending connection is closed so the listener keeps accepting. */
 int msck_session_accept(msck_ctx_t* ctx, msck_session_t* session,
                         uintptr_t data, msck_session_t** out_newsession);
 
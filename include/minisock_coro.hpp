@@ -0,0 +1,311 @@
+#ifndef __YUNI_MINISOCK_CORO_HPP
+#define __YUNI_MINISOCK_CORO_HPP
+
+/*
+ * C++20 coroutine facade for minisock
+ *
+ * Pass msck::coro::dispatch as the context callback. Each msck::coro::session
+ * is passed as data_session and has at most one waiting coroutine, which
+ * is resumed directly from the context callback. Awaiters are temporaries
+ * in the coroutine frame so there is no per-operation allocation.
+ *
+ *   msck::coro::task
+ *   echo(msck_ctx_t* ctx, msck::coro::session& listener){
+ *       msck::coro::session s;
+ *       char buf[4096];
+ *       if(co_await msck::coro::accept(ctx, listener, s)){
+ *           co_return;
+ *       }
+ *       for(;;){
+ *           auto r = co_await msck::coro::read(ctx, s, buf, sizeof(buf));
+ *           if(r.err || ! r.count){
+ *               break;
+ *           }
+ *           if(co_await msck::coro::write(ctx, s, buf, r.count)){
+ *               break;
+ *           }
+ *       }
+ *       msck::coro::close(ctx, s);
+ *   }
+ */
+
+#include <cstddef>
+#include <coroutine>
+#include <exception>
+#include "minisock.h"
+
+namespace msck {
+namespace coro {
+
+/* Fire-and-forget coroutine; the frame frees itself on completion */
+struct task {
+    struct promise_type {
+        task get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+/*
+ * Per-session state. Must stay alive until close(); usually a local in
+ * the coroutine that owns the session.
+ */
+struct session {
+    msck_session_t* handle = nullptr;
+
+    /* Waiting coroutine and the event it waits for */
+    std::coroutine_handle<> waiter;
+    msck_event_t wait_event = MSCK_EVENT_TYPE_SESSION_TERMINATE;
+
+    /* Result of the last CREATE_RESULT/SEND_RESULT/TERMINATE */
+    msck_error_t err = MSCK_SUCCESS;
+    uintptr_t arg0 = 0;
+
+    int pending_accept = 0; /* Listener only: INCOMING not yet accepted */
+    bool terminated = false;
+
+    session() = default;
+    session(const session&) = delete;
+    session& operator=(const session&) = delete;
+};
+
+struct read_result {
+    msck_error_t err;
+    size_t count; /* 0 with MSCK_SUCCESS: terminated, see session::arg0 */
+};
+
+namespace detail {
+
+inline void
+wake(session* s){
+    std::coroutine_handle<> h;
+    if(! s->waiter){
+        return;
+    }
+    h = s->waiter;
+    s->waiter = nullptr;
+    /* Do not touch s after this; the coroutine may close it */
+    h.resume();
+}
+
+inline void
+wait_for(session& s, msck_event_t ev, std::coroutine_handle<> h){
+    s.waiter = h;
+    s.wait_event = ev;
+}
+
+} /* namespace detail */
+
+/* msck_ctx_callback_t */
+inline void
+dispatch(msck_ctx_t* ctx, msck_event_t type, msck_error_t err,
+         msck_session_t* handle, const char* buf, uintptr_t arg0,
+         uintptr_t data_ctx, uintptr_t data_session){
+    session* s;
+    (void)ctx;
+    (void)handle;
+    (void)buf;
+    (void)data_ctx;
+    s = reinterpret_cast<session*>(data_session);
+    if(! s){
+        return;
+    }
+    switch(type){
+        case MSCK_EVENT_TYPE_SESSION_CREATE_RESULT:
+        case MSCK_EVENT_TYPE_SESSION_SEND_RESULT:
+            s->err = err;
+            s->arg0 = arg0;
+            if(err && type == MSCK_EVENT_TYPE_SESSION_CREATE_RESULT){
+                s->terminated = true;
+                detail::wake(s);
+            }else if(s->wait_event == type){
+                detail::wake(s);
+            }
+            break;
+        case MSCK_EVENT_TYPE_SESSION_INCOMING:
+            s->pending_accept++;
+            if(s->wait_event == type){
+                detail::wake(s);
+            }
+            break;
+        case MSCK_EVENT_TYPE_SESSION_TERMINATE:
+            s->err = err;
+            s->arg0 = arg0;
+            s->terminated = true;
+            detail::wake(s);
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * Awaiters
+ */
+
+struct connect_awaiter {
+    msck_ctx_t* ctx;
+    session& s;
+    msck_name_type_t nt;
+    const char* name;
+    size_t namelen;
+    int port;
+    msck_error_t r;
+
+    bool await_ready() const noexcept { return false; }
+    bool
+    await_suspend(std::coroutine_handle<> h) noexcept {
+        s.err = MSCK_SUCCESS;
+        s.terminated = false;
+        r = (msck_error_t)msck_session_create(ctx, MSCK_SESSION_TYPE_STREAM,
+                                              nt, name, namelen, port, 0,
+                                              reinterpret_cast<uintptr_t>(&s),
+                                              &s.handle);
+        if(r){
+            return false;
+        }
+        detail::wait_for(s, MSCK_EVENT_TYPE_SESSION_CREATE_RESULT, h);
+        return true;
+    }
+    msck_error_t await_resume() const noexcept { return r ? r : s.err; }
+};
+
+struct accept_awaiter {
+    msck_ctx_t* ctx;
+    session& listener;
+    session& s;
+
+    bool
+    await_ready() const noexcept {
+        return listener.pending_accept || listener.terminated;
+    }
+    void
+    await_suspend(std::coroutine_handle<> h) noexcept {
+        detail::wait_for(listener, MSCK_EVENT_TYPE_SESSION_INCOMING, h);
+    }
+    msck_error_t
+    await_resume() noexcept {
+        if(! listener.pending_accept){
+            return listener.err ? listener.err : MSCK_ERROR_BACKEND;
+        }
+        listener.pending_accept--;
+        s.err = MSCK_SUCCESS;
+        s.terminated = false;
+        return (msck_error_t)msck_session_accept(ctx, listener.handle,
+                                                 reinterpret_cast<uintptr_t>(&s),
+                                                 &s.handle);
+    }
+};
+
+struct read_awaiter {
+    msck_ctx_t* ctx;
+    session& s;
+    char* buf;
+    size_t buflen;
+    read_result res;
+
+    bool
+    await_ready() noexcept {
+        res.err = (msck_error_t)msck_session_read(ctx, s.handle, buf, buflen,
+                                                  &res.count);
+        return res.err || res.count || s.terminated;
+    }
+    void
+    await_suspend(std::coroutine_handle<> h) noexcept {
+        detail::wait_for(s, MSCK_EVENT_TYPE_SESSION_INCOMING, h);
+    }
+    read_result
+    await_resume() noexcept {
+        if(! res.err && ! res.count && ! s.terminated){
+            res.err = (msck_error_t)msck_session_read(ctx, s.handle, buf,
+                                                      buflen, &res.count);
+        }
+        return res;
+    }
+};
+
+struct write_awaiter {
+    msck_ctx_t* ctx;
+    session& s;
+    const char* data;
+    size_t datalen;
+    msck_error_t r;
+
+    bool await_ready() const noexcept { return false; }
+    bool
+    await_suspend(std::coroutine_handle<> h) noexcept {
+        size_t count;
+        if(s.terminated){
+            r = s.err ? s.err : MSCK_ERROR_BACKEND;
+            return false;
+        }
+        s.err = MSCK_SUCCESS;
+        r = (msck_error_t)msck_session_write(ctx, s.handle, data, datalen,
+                                             &count);
+        if(r){
+            return false;
+        }
+        detail::wait_for(s, MSCK_EVENT_TYPE_SESSION_SEND_RESULT, h);
+        return true;
+    }
+    msck_error_t await_resume() const noexcept { return r ? r : s.err; }
+};
+
+/*
+ * Operations
+ */
+
+/* Resumes with the CREATE_RESULT error */
+inline connect_awaiter
+connect(msck_ctx_t* ctx, session& s, msck_name_type_t nt,
+        const char* name, size_t namelen, int port){
+    return connect_awaiter{ctx, s, nt, name, namelen, port, MSCK_SUCCESS};
+}
+
+/* Listening has no CREATE_RESULT on success; errors come via accept() */
+inline msck_error_t
+listen(msck_ctx_t* ctx, session& listener, msck_name_type_t nt,
+       const char* name, size_t namelen, int port){
+    listener.err = MSCK_SUCCESS;
+    listener.terminated = false;
+    listener.pending_accept = 0;
+    return (msck_error_t)msck_session_create(ctx,
+                                             MSCK_SESSION_TYPE_STREAM_SERVER,
+                                             nt, name, namelen, port, 0,
+                                             reinterpret_cast<uintptr_t>(&listener),
+                                             &listener.handle);
+}
+
+/* Only one coroutine may wait on a listener at a time */
+inline accept_awaiter
+accept(msck_ctx_t* ctx, session& listener, session& s){
+    return accept_awaiter{ctx, listener, s};
+}
+
+inline read_awaiter
+read(msck_ctx_t* ctx, session& s, char* buf, size_t buflen){
+    return read_awaiter{ctx, s, buf, buflen, {MSCK_SUCCESS, 0}};
+}
+
+/* Resumes with the SEND_RESULT error; data is copied by the backend */
+inline write_awaiter
+write(msck_ctx_t* ctx, session& s, const char* data, size_t datalen){
+    return write_awaiter{ctx, s, data, datalen, MSCK_SUCCESS};
+}
+
+/* A coroutine still waiting on s will never be resumed */
+inline void
+close(msck_ctx_t* ctx, session& s){
+    if(s.handle){
+        msck_session_destroy(ctx, s.handle);
+        s.handle = nullptr;
+    }
+    s.waiter = nullptr;
+}
+
+} /* namespace coro */
+} /* namespace msck */
+
+#endif
@@ -0,0 +1,254 @@
+#ifndef __YUNI_MINISOCK_HANDLER_HPP
+#define __YUNI_MINISOCK_HANDLER_HPP
+
+/*
+ * Compile-time dispatched C++20 handler API for minisock
+ *
+ * msck::context<Handler> registers a per-Handler callback with the
+ * backend. The callback resolves every event to a Handler member function
+ * at compile time, so the handler bodies can be inlined into it. A
+ * handler only declares the events it cares about:
+ *
+ *   struct echo {
+ *       struct session_state { size_t total = 0; };
+ *       using ctx_type = msck::context<echo>;
+ *       using session_type = msck::session<echo>;
+ *
+ *       void on_accept(ctx_type& c, session_type& listener);
+ *       void on_readable(ctx_type& c, session_type& s);
+ *       void on_terminate(ctx_type& c, session_type& s,
+ *                         msck_error_t err, uintptr_t arg0);
+ *   };
+ *
+ * Handler events (all optional):
+ *   on_connect(ctx, session, err, arg0)    CREATE_RESULT
+ *   on_send(ctx, session, err, arg0)       SEND_RESULT
+ *   on_accept(ctx, listener)               INCOMING on a listener
+ *   on_readable(ctx, session)              INCOMING on a stream
+ *   on_data(ctx, session, span)            DATA
+ *   on_terminate(ctx, session, err, arg0)  TERMINATE
+ *
+ * The backend still calls through msck_ctx_callback_t once per event;
+ * there is no further indirect call or cast in user code.
+ *
+ * An event member that cannot be called with the arguments above, or a
+ * member with a common misspelling of an event name (on_read, on_close,
+ * ...), is a compile error rather than a silently dropped event.
+ */
+
+#include <cstddef>
+#include <span>
+#include <utility>
+#include "minisock.h"
+
+namespace msck {
+
+template<typename Handler> class context;
+
+/* Session with typed per-session state; must outlive the backend session */
+template<typename Handler>
+class session {
+public:
+    using state_type = typename Handler::session_state;
+
+    state_type state;
+
+    session() = default;
+    session(const session&) = delete;
+    session& operator=(const session&) = delete;
+
+    msck_session_t* handle() const { return handle_; }
+    bool is_listener() const { return listener_; }
+
+private:
+    friend class context<Handler>;
+    msck_session_t* handle_ = nullptr;
+    bool listener_ = false;
+};
+
+template<typename Handler>
+class context {
+public:
+    using session_type = session<Handler>;
+
+    Handler handler;
+
+    template<typename... Args>
+    explicit context(Args&&... args)
+        : handler(std::forward<Args>(args)...){}
+    context(const context&) = delete;
+    context& operator=(const context&) = delete;
+
+    ~context(){
+        if(ctx_){
+            msck_ctx_destroy(ctx_);
+        }
+    }
+
+    msck_error_t
+    init(){
+        return (msck_error_t)msck_ctx_create_default(&callback,
+                                                     reinterpret_cast<uintptr_t>(this),
+                                                     &ctx_);
+    }
+
+    msck_ctx_t* handle() const { return ctx_; }
+
+    void step(bool waitok){ msck_ctx_step(ctx_, waitok ? 1 : 0); }
+
+    msck_error_t
+    connect(session_type& s, msck_name_type_t nt,
+            std::span<const char> name, int port){
+        s.listener_ = false;
+        return (msck_error_t)msck_session_create(ctx_,
+                                                 MSCK_SESSION_TYPE_STREAM,
+                                                 nt, name.data(), name.size(),
+                                                 port, 0,
+                                                 reinterpret_cast<uintptr_t>(&s),
+                                                 &s.handle_);
+    }
+
+    msck_error_t
+    listen(session_type& s, msck_name_type_t nt,
+           std::span<const char> name, int port){
+        s.listener_ = true;
+        return (msck_error_t)msck_session_create(ctx_,
+                                                 MSCK_SESSION_TYPE_STREAM_SERVER,
+                                                 nt, name.data(), name.size(),
+                                                 port, 0,
+                                                 reinterpret_cast<uintptr_t>(&s),
+                                                 &s.handle_);
+    }
+
+    msck_error_t
+    accept(session_type& listener, session_type& s){
+        s.listener_ = false;
+        return (msck_error_t)msck_session_accept(ctx_, listener.handle_,
+                                                 reinterpret_cast<uintptr_t>(&s),
+                                                 &s.handle_);
+    }
+
+    /* out is the filled prefix of buf; empty when nothing is queued */
+    msck_error_t
+    read(session_type& s, std::span<char> buf, std::span<char>& out){
+        size_t count;
+        msck_error_t r;
+        r = (msck_error_t)msck_session_read(ctx_, s.handle_, buf.data(),
+                                            buf.size(), &count);
+        out = buf.first(r ? 0 : count);
+        return r;
+    }
+
+    msck_error_t
+    write(session_type& s, std::span<const char> data){
+        size_t count;
+        return (msck_error_t)msck_session_write(ctx_, s.handle_, data.data(),
+                                                data.size(), &count);
+    }
+
+    void
+    destroy(session_type& s){
+        if(s.handle_){
+            msck_session_destroy(ctx_, s.handle_);
+            s.handle_ = nullptr;
+        }
+    }
+
+private:
+    msck_ctx_t* ctx_ = nullptr;
+
+    /* Declared as a single (non-template) member, so &H::on_x is valid */
+#define MSCK_HANDLER_DECLARES(name) requires { &Handler::name; }
+#define MSCK_HANDLER_CHECK(name, call, sig) \
+    static_assert(! MSCK_HANDLER_DECLARES(name) || \
+                  requires(Handler& h, context& c, session_type& s, \
+                           std::span<const char> d){ call; }, \
+                  "Handler::" #name " must be callable as " #name sig)
+#define MSCK_HANDLER_REJECT(name, hint) \
+    static_assert(! MSCK_HANDLER_DECLARES(name), \
+                  "Handler::" #name " is not a minisock event; " hint)
+
+    static constexpr bool
+    check_handler(){
+        MSCK_HANDLER_CHECK(on_connect, h.on_connect(c, s, MSCK_SUCCESS, 0),
+                           "(ctx_type&, session_type&, msck_error_t, uintptr_t)");
+        MSCK_HANDLER_CHECK(on_send, h.on_send(c, s, MSCK_SUCCESS, 0),
+                           "(ctx_type&, session_type&, msck_error_t, uintptr_t)");
+        MSCK_HANDLER_CHECK(on_accept, h.on_accept(c, s),
+                           "(ctx_type&, session_type&)");
+        MSCK_HANDLER_CHECK(on_readable, h.on_readable(c, s),
+                           "(ctx_type&, session_type&)");
+        MSCK_HANDLER_CHECK(on_data, h.on_data(c, s, d),
+                           "(ctx_type&, session_type&, std::span<const char>)");
+        MSCK_HANDLER_CHECK(on_terminate, h.on_terminate(c, s, MSCK_SUCCESS, 0),
+                           "(ctx_type&, session_type&, msck_error_t, uintptr_t)");
+        MSCK_HANDLER_REJECT(on_read, "use on_readable or on_data");
+        MSCK_HANDLER_REJECT(on_incoming, "use on_accept or on_readable");
+        MSCK_HANDLER_REJECT(on_connected, "use on_connect");
+        MSCK_HANDLER_REJECT(on_create_result, "use on_connect");
+        MSCK_HANDLER_REJECT(on_write, "use on_send");
+        MSCK_HANDLER_REJECT(on_sent, "use on_send");
+        MSCK_HANDLER_REJECT(on_send_result, "use on_send");
+        MSCK_HANDLER_REJECT(on_close, "use on_terminate");
+        MSCK_HANDLER_REJECT(on_closed, "use on_terminate");
+        MSCK_HANDLER_REJECT(on_terminated, "use on_terminate");
+        MSCK_HANDLER_REJECT(on_error, "errors come with on_connect/on_send/on_terminate");
+        return true;
+    }
+#undef MSCK_HANDLER_REJECT
+#undef MSCK_HANDLER_CHECK
+#undef MSCK_HANDLER_DECLARES
+
+    static void
+    callback(msck_ctx_t* ctx, msck_event_t type, msck_error_t err,
+             msck_session_t* handle, const char* buf, uintptr_t arg0,
+             uintptr_t data_ctx, uintptr_t data_session){
+        context& c = *reinterpret_cast<context*>(data_ctx);
+        session_type& s = *reinterpret_cast<session_type*>(data_session);
+        Handler& h = c.handler;
+        static_assert(check_handler());
+        (void)ctx;
+        (void)handle;
+        (void)buf;
+        switch(type){
+            case MSCK_EVENT_TYPE_SESSION_CREATE_RESULT:
+                if constexpr(requires { h.on_connect(c, s, err, arg0); }){
+                    h.on_connect(c, s, err, arg0);
+                }
+                break;
+            case MSCK_EVENT_TYPE_SESSION_SEND_RESULT:
+                if constexpr(requires { h.on_send(c, s, err, arg0); }){
+                    h.on_send(c, s, err, arg0);
+                }
+                break;
+            case MSCK_EVENT_TYPE_SESSION_INCOMING:
+                if(s.listener_){
+                    if constexpr(requires { h.on_accept(c, s); }){
+                        h.on_accept(c, s);
+                    }
+                }else{
+                    if constexpr(requires { h.on_readable(c, s); }){
+                        h.on_readable(c, s);
+                    }
+                }
+                break;
+            case MSCK_EVENT_TYPE_SESSION_DATA:
+                if constexpr(requires {
+                    h.on_data(c, s, std::span<const char>(buf, arg0)); }){
+                    h.on_data(c, s, std::span<const char>(buf, arg0));
+                }
+                break;
+            case MSCK_EVENT_TYPE_SESSION_TERMINATE:
+                if constexpr(requires { h.on_terminate(c, s, err, arg0); }){
+                    h.on_terminate(c, s, err, arg0);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+};
+
+} /* namespace msck */
+
+#endif
@@ -0,0 +1,709 @@
+#include <stdio.h>
+#include <limits.h>
+#include <string.h>
+#include <stdlib.h>
+#include <uv.h>
+#include "minisock.h"
+
+#include "libuv-worker_priv.h"
+
+#ifdef MSCK_USE_OPENSSL
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#ifdef __linux__
+#include <linux/tls.h>
+#endif
+
+/*
+ * TLS sessions
+ *
+ * The handshake runs in user space with memory BIOs; ciphertext goes
+ * through the usual uv_read/uv_write of the session. Once the handshake
+ * is complete, TLS 1.3 AES-GCM/ChaCha20 record crypto is moved to kernel
+ * TLS so msck_session_write/read take the plaintext stream path.
+ * Otherwise records are encrypted/decrypted here (user-space fallback).
+ *
+ * Client sessions only offload TX: servers may send NewSessionTicket
+ * records at any time, which kTLS RX would reject. Our own server
+ * contexts disable tickets so both directions can be offloaded.
+ */
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+#define TLS_READ_CHUNK (64*1024)
+
+struct msck_tls_ctx_s {
+    SSL_CTX* client;
+    SSL_CTX* server; /* NULL if no certificate */
+    int flags;
+};
+
+struct msck_tls_s {
+    SSL* ssl;
+    BIO* rbio; /* Ciphertext from peer */
+    BIO* wbio; /* Ciphertext to peer */
+    int server;
+    int handshake_done;
+    int hs_writes; /* Handshake flights not yet written */
+    int tx_offload;
+    int rx_offload;
+    size_t secret_len;
+    unsigned char secret_client[EVP_MAX_MD_SIZE];
+    unsigned char secret_server[EVP_MAX_MD_SIZE];
+};
+
+struct hs_write {
+    uv_write_t req;
+    msck_session_t* s;
+    uv_buf_t buf;
+};
+
+static void
+cb_keylog(const SSL* ssl, const char* line){
+    /* Capture TLS 1.3 application traffic secrets for kTLS */
+    struct msck_tls_s* t;
+    unsigned char* out;
+    const char* p;
+    size_t len;
+    size_t i;
+    unsigned int v;
+    t = (struct msck_tls_s*)SSL_get_app_data(ssl);
+    if(! strncmp(line, "CLIENT_TRAFFIC_SECRET_0 ", 24)){
+        out = t->secret_client;
+    }else if(! strncmp(line, "SERVER_TRAFFIC_SECRET_0 ", 24)){
+        out = t->secret_server;
+    }else{
+        return;
+    }
+    p = strrchr(line, ' ');
+    if(! p){
+        return;
+    }
+    p++;
+    len = strlen(p) / 2;
+    if(len > EVP_MAX_MD_SIZE){
+        return;
+    }
+    for(i=0;i!=len;i++){
+        if(sscanf(p + i*2, "%2x", &v) != 1){
+            return;
+        }
+        out[i] = (unsigned char)v;
+    }
+    t->secret_len = len;
+}
+
+/* TLS 1.3 HKDF-Expand-Label with an empty context */
+static int
+hkdf_expand_label(const EVP_MD* md, const unsigned char* secret,
+                  size_t secret_len, const char* label,
+                  unsigned char* out, size_t outlen){
+    EVP_PKEY_CTX* pctx;
+    unsigned char info[2 + 1 + 255 + 1];
+    size_t labellen;
+    size_t infolen;
+    int ok;
+    labellen = strlen("tls13 ") + strlen(label);
+    info[0] = (unsigned char)(outlen >> 8);
+    info[1] = (unsigned char)outlen;
+    info[2] = (unsigned char)labellen;
+    memcpy(info + 3, "tls13 ", 6);
+    memcpy(info + 9, label, strlen(label));
+    infolen = 3 + labellen;
+    info[infolen++] = 0; /* context */
+
+    pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+    if(! pctx){
+        return 0;
+    }
+    ok = EVP_PKEY_derive_init(pctx) > 0
+        && EVP_PKEY_CTX_set_hkdf_mode(pctx,
+                                      EVP_PKEY_HKDEF_MODE_EXPAND_ONLY) > 0
+        && EVP_PKEY_CTX_set_hkdf_md(pctx, md) > 0
+        && EVP_PKEY_CTX_set1_hkdf_key(pctx, secret, (int)secret_len) > 0
+        && EVP_PKEY_CTX_add1_hkdf_info(pctx, info, (int)infolen) > 0
+        && EVP_PKEY_derive(pctx, out, &outlen) > 0;
+    EVP_PKEY_CTX_free(pctx);
+    return ok;
+}
+
+#ifdef TLS_1_3_VERSION
+static int /* 0 on success */
+ktls_install(msck_session_t* s, int dir, const unsigned char* secret){
+    struct msck_tls_s* t;
+    const SSL_CIPHER* cipher;
+    const EVP_MD* md;
+    union {
+        struct tls_crypto_info info;
+        struct tls12_crypto_info_aes_gcm_128 aes128;
+        struct tls12_crypto_info_aes_gcm_256 aes256;
+        struct tls12_crypto_info_chacha20_poly1305 chacha;
+    } ci;
+    socklen_t cilen;
+    unsigned char key[32];
+    unsigned char iv[12];
+    size_t keylen;
+    uv_os_fd_t fd;
+    int r;
+
+    t = s->tls;
+    cipher = SSL_get_current_cipher(t->ssl);
+    md = SSL_CIPHER_get_handshake_digest(cipher);
+    if(! md){
+        return -1;
+    }
+    switch(SSL_CIPHER_get_id(cipher) & 0xffff){
+        case 0x1301: /* TLS_AES_128_GCM_SHA256 */
+            keylen = 16;
+            break;
+        case 0x1302: /* TLS_AES_256_GCM_SHA384 */
+        case 0x1303: /* TLS_CHACHA20_POLY1305_SHA256 */
+            keylen = 32;
+            break;
+        default:
+            return -1;
+    }
+    if(! hkdf_expand_label(md, secret, t->secret_len, "key", key, keylen)
+       || ! hkdf_expand_label(md, secret, t->secret_len, "iv", iv, 12)){
+        return -1;
+    }
+
+    memset(&ci, 0, sizeof(ci));
+    ci.info.version = TLS_1_3_VERSION;
+    /* rec_seq stays zero: no records were sent with these keys yet */
+    switch(SSL_CIPHER_get_id(cipher) & 0xffff){
+        case 0x1301:
+            ci.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+            memcpy(ci.aes128.key, key, 16);
+            memcpy(ci.aes128.salt, iv, 4);
+            memcpy(ci.aes128.iv, iv + 4, 8);
+            cilen = sizeof(ci.aes128);
+            break;
+        case 0x1302:
+            ci.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+            memcpy(ci.aes256.key, key, 32);
+            memcpy(ci.aes256.salt, iv, 4);
+            memcpy(ci.aes256.iv, iv + 4, 8);
+            cilen = sizeof(ci.aes256);
+            break;
+        default:
+            ci.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+            memcpy(ci.chacha.key, key, 32);
+            memcpy(ci.chacha.iv, iv, 12);
+            cilen = sizeof(ci.chacha);
+            break;
+    }
+    OPENSSL_cleanse(key, sizeof(key));
+    OPENSSL_cleanse(iv, sizeof(iv));
+
+    r = uv_fileno((uv_handle_t*)&s->handle.tcp, &fd);
+    if(r){
+        return -1;
+    }
+    if(! t->tx_offload && ! t->rx_offload){
+        if(setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls"))){
+            OPENSSL_cleanse(&ci, sizeof(ci));
+            return -1;
+        }
+    }
+    r = setsockopt(fd, SOL_TLS, dir, &ci, cilen);
+    OPENSSL_cleanse(&ci, sizeof(ci));
+    return r;
+}
+#endif
+
+static void
+ktls_setup(msck_ctx_t* ctx, msck_session_t* s){
+#ifdef TLS_1_3_VERSION
+    struct msck_tls_s* t;
+    const unsigned char* tx;
+    const unsigned char* rx;
+    t = s->tls;
+    if(ctx->tls->flags & MSCK_TLS_DISABLE_KTLS){
+        return;
+    }
+    if(SSL_version(t->ssl) != TLS1_3_VERSION || ! t->secret_len){
+        return;
+    }
+    tx = t->server ? t->secret_server : t->secret_client;
+    rx = t->server ? t->secret_client : t->secret_server;
+    if(! ktls_install(s, TLS_TX, tx)){
+        t->tx_offload = 1;
+    }
+    /* RX only if nothing past the handshake is buffered in user space */
+    if(t->tx_offload && t->server
+       && ! BIO_ctrl_pending(t->rbio) && ! SSL_pending(t->ssl)){
+        if(! ktls_install(s, TLS_RX, rx)){
+            t->rx_offload = 1;
+        }
+    }
+#endif
+    OPENSSL_cleanse(s->tls->secret_client, sizeof(s->tls->secret_client));
+    OPENSSL_cleanse(s->tls->secret_server, sizeof(s->tls->secret_server));
+}
+
+static void
+handshake_failed(msck_ctx_t* ctx, msck_session_t* s, uintptr_t detail){
+    /* Reported once; anything the peer sends afterwards is ignored */
+    s->read_active = 0;
+    (void)uv_read_stop(&s->handle.stream);
+    s->session_state = SESSION_DEFUNCT;
+    ERR_clear_error();
+    ctx_event(ctx, MSCK_EVENT_TYPE_SESSION_CREATE_RESULT,
+              MSCK_ERROR_TLS, s, 0, detail, ctx->data, s->data);
+}
+
+static void
+handshake_finish(msck_ctx_t* ctx, msck_session_t* s){
+    struct msck_tls_s* t;
+    t = s->tls;
+    if(! t->handshake_done || t->hs_writes
+       || s->session_state != SESSION_CONNECTING){
+        return;
+    }
+    /* Every handshake byte is on the wire; safe to switch to kTLS */
+    ktls_setup(ctx, s);
+    s->session_state = SESSION_IDLE;
+    ctx_event(ctx, MSCK_EVENT_TYPE_SESSION_CREATE_RESULT,
+              MSCK_SUCCESS, s, 0, 0, ctx->data, s->data);
+    if(s->session_state == SESSION_CLOSING){
+        return;
+    }
+    /* Application data may have arrived with the last handshake flight */
+    if(BIO_ctrl_pending(t->rbio)){
+        msck_tls_pump(ctx, s, 1);
+    }
+}
+
+static void
+cb_hs_write(uv_write_t* req, int status){
+    struct hs_write* w;
+    msck_session_t* s;
+    msck_ctx_t* ctx;
+    w = (struct hs_write*)req->data;
+    s = w->s;
+    ctx = s->loop->data;
+    ensure_in_loop(ctx);
+    free(w);
+    if(s->session_state != SESSION_CONNECTING){
+        /* Destroyed or already failed */
+        return;
+    }
+    s->tls->hs_writes--;
+    if(status){
+        handshake_failed(ctx, s, status);
+        return;
+    }
+    handshake_finish(ctx, s);
+}
+
+static int /* backend error */
+flush_handshake(msck_session_t* s){
+    struct msck_tls_s* t;
+    struct hs_write* w;
+    size_t len;
+    int r;
+    t = s->tls;
+    len = BIO_ctrl_pending(t->wbio);
+    if(! len){
+        return 0;
+    }
+    w = malloc(sizeof(struct hs_write) + len);
+    if(! w){
+        return UV_ENOMEM;
+    }
+    w->s = s;
+    w->buf.base = (char*)w + sizeof(struct hs_write);
+    w->buf.len = BIO_read(t->wbio, w->buf.base, (int)len);
+    w->req.data = w;
+    r = uv_write(&w->req, &s->handle.stream, &w->buf, 1, cb_hs_write);
+    if(r){
+        free(w);
+        return r;
+    }
+    t->hs_writes++;
+    return 0;
+}
+
+static void
+handshake_step(msck_ctx_t* ctx, msck_session_t* s){
+    struct msck_tls_s* t;
+    int r;
+    int e;
+    t = s->tls;
+    ERR_clear_error();
+    r = SSL_do_handshake(t->ssl);
+    e = flush_handshake(s);
+    if(e){
+        handshake_failed(ctx, s, e);
+        return;
+    }
+    if(r == 1){
+        t->handshake_done = 1;
+        handshake_finish(ctx, s);
+        return;
+    }
+    switch(SSL_get_error(t->ssl, r)){
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            return;
+        default:
+            handshake_failed(ctx, s, ERR_peek_last_error());
+            return;
+    }
+}
+
+void
+msck_tls_pump(msck_ctx_t* ctx, msck_session_t* s, int notify){
+    struct msck_tls_s* t;
+    char* p;
+    size_t len;
+    int r;
+    int e;
+    t = s->tls;
+    if(s->session_state == SESSION_CONNECTING){
+        /* Queued until handshake_finish */
+        return;
+    }
+    ERR_clear_error();
+    while(! s->recvq[1].base){
+        p = malloc(TLS_READ_CHUNK);
+        if(! p){
+            return;
+        }
+        len = 0;
+        e = SSL_ERROR_NONE;
+        while(len < TLS_READ_CHUNK){
+            r = SSL_read(t->ssl, p + len, TLS_READ_CHUNK - len);
+            if(r <= 0){
+                /* Before the callback below can re-enter SSL_read */
+                e = SSL_get_error(t->ssl, r);
+                break;
+            }
+            len += r;
+        }
+        if(len){
+            stream_queue_read(ctx, s, p, len, notify);
+            if(s->session_state != SESSION_IDLE
+               && s->session_state != SESSION_ACTIVE){
+                /* Destroyed or terminated from the callback */
+                return;
+            }
+        }else{
+            free(p);
+        }
+        if(e == SSL_ERROR_NONE){
+            /* Chunk full */
+            continue;
+        }
+        if(e == SSL_ERROR_WANT_READ || ! notify){
+            /* Report errors from the read callback, not msck_session_read;
+             * SSL_read keeps failing so they won't be lost */
+            return;
+        }
+        switch(e){
+            case SSL_ERROR_ZERO_RETURN:
+                /* close_notify: same as EOF */
+                stream_terminate(ctx, s, MSCK_ERROR_BACKEND, UV_EOF);
+                return;
+            default:
+                ERR_clear_error();
+                stream_terminate(ctx, s, MSCK_ERROR_TLS, 0);
+                return;
+        }
+    }
+}
+
+void
+msck_tls_feed(msck_ctx_t* ctx, msck_session_t* s, const char* buf,
+              size_t len){
+    struct msck_tls_s* t;
+    t = s->tls;
+    switch(s->session_state){
+        case SESSION_CONNECTING:
+        case SESSION_IDLE:
+        case SESSION_ACTIVE:
+            break;
+        default:
+            /* Failed or terminated */
+            return;
+    }
+    (void)BIO_write(t->rbio, buf, (int)len);
+    if(! t->handshake_done){
+        handshake_step(ctx, s);
+    }else{
+        msck_tls_pump(ctx, s, 1);
+    }
+}
+
+void
+msck_tls_start(msck_ctx_t* ctx, msck_session_t* s){
+    handshake_step(ctx, s);
+}
+
+int
+msck_tls_rx_offloaded(msck_session_t* s){
+    return s->tls->rx_offload;
+}
+
+int
+msck_tls_tx_offloaded(msck_session_t* s){
+    return s->tls->tx_offload;
+}
+
+int /* MSCK error */
+msck_tls_encrypt(msck_session_t* s, const char* data, size_t datalen,
+                 size_t headroom, char** out, size_t* outlen){
+    struct msck_tls_s* t;
+    size_t len;
+    char* p;
+    t = s->tls;
+    if(datalen > INT_MAX){
+        return MSCK_ERROR_INVALID_ARGUMENT;
+    }
+    if(datalen && SSL_write(t->ssl, data, (int)datalen) <= 0){
+        ERR_clear_error();
+        return MSCK_ERROR_TLS;
+    }
+    len = BIO_ctrl_pending(t->wbio);
+    p = malloc(headroom + len);
+    if(! p){
+        (void)BIO_reset(t->wbio);
+        return MSCK_ERROR_BACKEND;
+    }
+    (void)BIO_read(t->wbio, p + headroom, (int)len);
+    *out = p;
+    *outlen = len;
+    return MSCK_SUCCESS;
+}
+
+int
+msck_tls_server_ready(msck_ctx_t* ctx){
+    return ctx->tls && ctx->tls->server;
+}
+
+int /* MSCK error */
+msck_tls_session_init(msck_ctx_t* ctx, msck_session_t* s, int server,
+                      const char* host, size_t hostlen,
+                      const void* ip, size_t iplen){
+    struct msck_tls_s* t;
+    char* hostbuf;
+    SSL_CTX* sctx;
+    if(! ctx->tls){
+        return MSCK_ERROR_INVALID_ARGUMENT;
+    }
+    sctx = server ? ctx->tls->server : ctx->tls->client;
+    if(! sctx){
+        return MSCK_ERROR_INVALID_ARGUMENT;
+    }
+    if(! server && (ctx->tls->flags & MSCK_TLS_VERIFY_PEER)
+       && ! host && ! ip){
+        /* Chain alone does not authenticate the peer */
+        return MSCK_ERROR_INVALID_ARGUMENT;
+    }
+    t = malloc(sizeof(struct msck_tls_s));
+    if(! t){
+        return MSCK_ERROR_BACKEND;
+    }
+    memset(t, 0, sizeof(struct msck_tls_s));
+    t->server = server;
+    t->ssl = SSL_new(sctx);
+    t->rbio = BIO_new(BIO_s_mem());
+    t->wbio = BIO_new(BIO_s_mem());
+    if(! t->ssl || ! t->rbio || ! t->wbio){
+        goto fail;
+    }
+    BIO_set_mem_eof_return(t->rbio, -1);
+    SSL_set_bio(t->ssl, t->rbio, t->wbio);
+    SSL_set_app_data(t->ssl, t);
+    if(server){
+        SSL_set_accept_state(t->ssl);
+    }else{
+        SSL_set_connect_state(t->ssl);
+        if(host){
+            hostbuf = malloc(hostlen + 1);
+            if(! hostbuf){
+                goto fail_ssl;
+            }
+            memcpy(hostbuf, host, hostlen);
+            hostbuf[hostlen] = 0;
+            (void)SSL_set_tlsext_host_name(t->ssl, hostbuf);
+            if(ctx->tls->flags & MSCK_TLS_VERIFY_PEER
+               && SSL_set1_host(t->ssl, hostbuf) != 1){
+                free(hostbuf);
+                goto fail_ssl;
+            }
+            free(hostbuf);
+        }else if(ip && (ctx->tls->flags & MSCK_TLS_VERIFY_PEER)){
+            /* Address: no SNI (RFC6066 3), match iPAddress SAN */
+            if(X509_VERIFY_PARAM_set1_ip(SSL_get0_param(t->ssl),
+                                         ip, iplen) != 1){
+                goto fail_ssl;
+            }
+        }
+    }
+    s->tls = t;
+    return MSCK_SUCCESS;
+
+fail:
+    BIO_free(t->rbio);
+    BIO_free(t->wbio);
+fail_ssl:
+    SSL_free(t->ssl); /* Also frees BIOs once set */
+    free(t);
+    ERR_clear_error();
+    return MSCK_ERROR_BACKEND;
+}
+
+void
+msck_tls_session_free(msck_session_t* s){
+    if(! s->tls){
+        return;
+    }
+    SSL_free(s->tls->ssl);
+    OPENSSL_cleanse(s->tls, sizeof(struct msck_tls_s));
+    free(s->tls);
+    s->tls = 0;
+}
+
+void
+msck_tls_ctx_free(msck_ctx_t* ctx){
+    if(! ctx->tls){
+        return;
+    }
+    SSL_CTX_free(ctx->tls->client);
+    SSL_CTX_free(ctx->tls->server);
+    free(ctx->tls);
+    ctx->tls = 0;
+}
+
+int
+msck_ctx_tls_config(msck_ctx_t* ctx, const char* certfile,
+                    const char* keyfile, const char* cafile, int flags){
+    struct msck_tls_ctx_s* c;
+    if((certfile && ! keyfile) || (! certfile && keyfile)){
+        return MSCK_ERROR_INVALID_ARGUMENT;
+    }
+    c = malloc(sizeof(struct msck_tls_ctx_s));
+    if(! c){
+        return MSCK_ERROR_BACKEND;
+    }
+    c->flags = flags;
+    c->server = 0;
+    c->client = SSL_CTX_new(TLS_client_method());
+    if(! c->client){
+        goto fail;
+    }
+    SSL_CTX_set_keylog_callback(c->client, cb_keylog);
+    if(flags & MSCK_TLS_VERIFY_PEER){
+        SSL_CTX_set_verify(c->client, SSL_VERIFY_PEER, NULL);
+        if(cafile){
+            if(SSL_CTX_load_verify_locations(c->client, cafile, NULL) != 1){
+                goto fail;
+            }
+        }else if(SSL_CTX_set_default_verify_paths(c->client) != 1){
+            goto fail;
+        }
+    }
+
+    if(certfile){
+        c->server = SSL_CTX_new(TLS_server_method());
+        if(! c->server){
+            goto fail;
+        }
+        SSL_CTX_set_keylog_callback(c->server, cb_keylog);
+        if(! (flags & MSCK_TLS_DISABLE_KTLS)){
+            /* Post-handshake tickets would break kTLS sequence numbers */
+            (void)SSL_CTX_set_num_tickets(c->server, 0);
+        }
+        if(SSL_CTX_use_certificate_chain_file(c->server, certfile) != 1
+           || SSL_CTX_use_PrivateKey_file(c->server, keyfile,
+                                          SSL_FILETYPE_PEM) != 1
+           || SSL_CTX_check_private_key(c->server) != 1){
+            goto fail;
+        }
+    }
+
+    msck_tls_ctx_free(ctx);
+    ctx->tls = c;
+    return MSCK_SUCCESS;
+
+fail:
+    SSL_CTX_free(c->client);
+    SSL_CTX_free(c->server);
+    free(c);
+    ERR_clear_error();
+    return MSCK_ERROR_TLS;
+}
+
+#else /* ! MSCK_USE_OPENSSL */
+
+/* Built without OpenSSL: s->tls and ctx->tls always stay NULL */
+
+void
+msck_tls_pump(msck_ctx_t* ctx, msck_session_t* s, int notify){
+}
+
+void
+msck_tls_feed(msck_ctx_t* ctx, msck_session_t* s, const char* buf,
+              size_t len){
+}
+
+void
+msck_tls_start(msck_ctx_t* ctx, msck_session_t* s){
+}
+
+int
+msck_tls_rx_offloaded(msck_session_t* s){
+    return 0;
+}
+
+int
+msck_tls_tx_offloaded(msck_session_t* s){
+    return 0;
+}
+
+int
+msck_tls_encrypt(msck_session_t* s, const char* data, size_t datalen,
+                 size_t headroom, char** out, size_t* outlen){
+    return MSCK_ERROR_UNIMPLEMENTED;
+}
+
+int
+msck_tls_server_ready(msck_ctx_t* ctx){
+    return 0;
+}
+
+int
+msck_tls_session_init(msck_ctx_t* ctx, msck_session_t* s, int server,
+                      const char* host, size_t hostlen,
+                      const void* ip, size_t iplen){
+    return MSCK_ERROR_UNIMPLEMENTED;
+}
+
+void
+msck_tls_session_free(msck_session_t* s){
+}
+
+void
+msck_tls_ctx_free(msck_ctx_t* ctx){
+}
+
+int
+msck_ctx_tls_config(msck_ctx_t* ctx, const char* certfile,
+                    const char* keyfile, const char* cafile, int flags){
+    return MSCK_ERROR_UNIMPLEMENTED;
+}
+
+#endif
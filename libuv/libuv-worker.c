@@ -13,6 +13,15 @@ ensure_in_loop(msck_ctx_t* ctx){
     }
 }
 
+void
+ctx_event(msck_ctx_t* ctx, msck_event_t type, msck_error_t err,
+          msck_session_t* s, const char* buf, uintptr_t arg0,
+          uintptr_t data_ctx, uintptr_t data_session){
+    /* Counted for msck_ctx_step_ex */
+    ctx->events++;
+    ctx->cb(ctx, type, err, s, buf, arg0, data_ctx, data_session);
+}
+
 /*
  * SESSION
  */
@@ -20,24 +29,126 @@ ensure_in_loop(msck_ctx_t* ctx){
 static void
 free_session(msck_ctx_t* ctx, msck_session_t* s){
     /* Return session back to the free list */
+    msck_tls_session_free(s);
     s->session_state = SESSION_FREE;
+    s->handle_valid = 0;
     s->next = ctx->queue_free;
     ctx->queue_free = s->id;
 }
 
+static void
+cb_close_session(uv_handle_t* handle){
+    msck_session_t* s;
+    msck_ctx_t* ctx;
+    s = (msck_session_t*)handle->data;
+    ctx = s->loop->data;
+    free_session(ctx, s);
+}
+
+static void
+release_session(msck_ctx_t* ctx, msck_session_t* s){
+    /* Free session, closing its handle first if we have one */
+    if(s->handle_valid){
+        s->session_state = SESSION_CLOSING;
+        s->handle.tcp.data = s;
+        uv_close((uv_handle_t*)&s->handle.tcp, cb_close_session);
+    }else{
+        free_session(ctx, s);
+    }
+}
+
 static void
 cb_alloc_stream_read(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf){
     buf->base = malloc(suggested_size);
     buf->len = suggested_size;
 }
 
+void
+stream_terminate(msck_ctx_t* ctx, msck_session_t* s,
+                 msck_error_t err, uintptr_t arg0){
+    s->read_active = 0;
+    (void)uv_read_stop(&s->handle.stream);
+    s->session_state = SESSION_DEFUNCT;
+    free(s->recvq[0].base);
+    free(s->recvq[1].base);
+    s->recvq[0].base = 0;
+    s->recvq[1].base = 0;
+    ctx_event(ctx, MSCK_EVENT_TYPE_SESSION_TERMINATE,
+              err, s, 0, arg0, ctx->data, s->data);
+}
+
+void
+stream_queue_read(msck_ctx_t* ctx, msck_session_t* s,
+                  char* base, size_t len, int notify){
+    /* Takes ownership of base */
+    int sel;
+    if(s->recvq[0].base){
+        s->read_active = 0;
+        (void)uv_read_stop(&s->handle.stream);
+        sel = 1;
+    }else{
+        sel = 0;
+    }
+    s->recvq[sel].base = base;
+    s->recvq[sel].len = len;
+    if(sel == 0){
+        s->readhead = 0;
+    }
+    if(notify){
+        ctx_event(ctx, MSCK_EVENT_TYPE_SESSION_INCOMING,
+                  MSCK_SUCCESS, s, 0, 0, ctx->data, s->data);
+    }
+}
+
+static void
+stream_charge_budget(msck_ctx_t* ctx, msck_session_t* s, size_t nread){
+    /* Per-iteration read budget; predispatch resumes throttled sessions */
+    int hit;
+    if(! ctx->budget_reads && ! ctx->budget_bytes){
+        return;
+    }
+    if(s->budget_iter != ctx->iter){
+        s->budget_iter = ctx->iter;
+        s->budget_reads = 0;
+        s->budget_bytes = 0;
+    }
+    s->budget_reads++;
+    s->budget_bytes += nread;
+    hit = 0;
+    if(ctx->budget_reads && s->budget_reads >= ctx->budget_reads){
+        ctx->stats.budget_read_hits++;
+        hit = 1;
+    }else if(ctx->budget_bytes && s->budget_bytes >= ctx->budget_bytes){
+        ctx->stats.budget_byte_hits++;
+        hit = 1;
+    }
+    if(! hit){
+        return;
+    }
+    if(s->session_state != SESSION_IDLE && s->session_state != SESSION_ACTIVE){
+        /* Terminated or destroyed from the callback */
+        return;
+    }
+    if(s->read_active){
+        s->read_active = 0;
+        (void)uv_read_stop(&s->handle.stream);
+    }
+    if(! s->throttled){
+        s->throttled = 1;
+        s->next_throttled = -1;
+        if(ctx->queue_throttled < 0){
+            ctx->queue_throttled = s->id;
+            /* Keep the loop alive even if every stream is throttled */
+            uv_ref((uv_handle_t*)&ctx->prepare);
+        }else{
+            ctx->sessions[ctx->queue_throttled_tail].next_throttled = s->id;
+        }
+        ctx->queue_throttled_tail = s->id;
+    }
+}
+
 static void
 cb_stream_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf){
-    size_t total;
-    char* p;
-    size_t offs;
-    int i;
-    int sel;
     msck_session_t* s;
     uv_loop_t* loop;
     msck_ctx_t* ctx;
@@ -47,49 +158,40 @@ cb_stream_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf){
     ensure_in_loop(ctx);
     if(nread == 0){
         /* Do nothing */
+        free(buf->base);
         return;
     }
     if(nread < 0){
-        (void)uv_read_stop(stream);
-        s->session_state = SESSION_DEFUNCT;
-        free(s->recvq[0].base);
-        free(s->recvq[1].base);
+        free(buf->base);
+        if(s->session_state == SESSION_CONNECTING){
+            /* TLS handshake in progress */
+            s->read_active = 0;
+            (void)uv_read_stop(stream);
+            s->session_state = SESSION_DEFUNCT;
+            ctx_event(ctx, MSCK_EVENT_TYPE_SESSION_CREATE_RESULT,
+                      MSCK_ERROR_TLS, s, 0, (uintptr_t)nread,
+                      ctx->data, s->data);
+            return;
+        }
         /* Error case */
-        ctx->cb(ctx, MSCK_EVENT_TYPE_SESSION_TERMINATE,
-                MSCK_ERROR_BACKEND, s,
-                0, (uintptr_t)nread, ctx->data, s->data);
+        stream_terminate(ctx, s, MSCK_ERROR_BACKEND, (uintptr_t)nread);
         return;
     }
-    if(s->recvq[0].base){
-        s->read_active = 0;
-        (void)uv_read_stop(stream);
-        sel = 1;
-    }else{
-        sel = 0;
-    }
-    if(nread > 1){
-        /* Merge buffers into one buffer */
-        total = 0;
-        for(i=0;i!=nread;i++){
-            total += buf[i].len;
-        }
-        p = malloc(total);
-        offs = 0;
-        for(i=0;i!=nread;i++){
-            memcpy(p + offs, buf[i].base, buf[i].len);
-            free(buf[i].base);
-            offs += buf[i].len;
+    if(s->tls && ! msck_tls_rx_offloaded(s)){
+        /* Ciphertext; plaintext gets queued by msck_tls_pump */
+        msck_tls_feed(ctx, s, buf->base, nread);
+        free(buf->base);
+        if(s->session_state != SESSION_CLOSING && s->recvq[1].base
+           && s->read_active){
+            s->read_active = 0;
+            (void)uv_read_stop(stream);
         }
-        s->recvq[sel].base = p;
-        s->recvq[sel].len = total;
-    }else{
-        s->recvq[sel] = buf[0];
-    }
-    if(sel == 0){
-        s->readhead = 0;
+        stream_charge_budget(ctx, s, nread);
+        return;
     }
-    ctx->cb(ctx, MSCK_EVENT_TYPE_SESSION_INCOMING,
-            MSCK_SUCCESS, s, 0, 0, ctx->data, s->data);
+    /* buf->len is the allocated size; only nread bytes are valid */
+    stream_queue_read(ctx, s, buf->base, nread, 1);
+    stream_charge_budget(ctx, s, nread);
 }
 
 static int /* backend error */
@@ -106,6 +208,11 @@ msck_session_read(msck_ctx_t* ctx, msck_session_t* session,
                   char* buf, size_t buflen, size_t* out_count){
     int r;
     size_t cur, ncur;
+    if(session->tls && ! msck_tls_rx_offloaded(session)
+       && ! session->recvq[1].base){
+        /* Decrypt ciphertext held back while recvq was full */
+        msck_tls_pump(ctx, session, 0);
+    }
     if(! session->recvq[0].base){
         *out_count = 0;
         return MSCK_SUCCESS;
@@ -137,9 +244,14 @@ msck_session_read(msck_ctx_t* ctx, msck_session_t* session,
             }
         }else{
             session->readhead = 0;
+            *out_count = cur;
         }
     }
-    if(! session->recvq[1].base){
+    if(session->tls && ! msck_tls_rx_offloaded(session)
+       && ! session->recvq[1].base){
+        msck_tls_pump(ctx, session, 0);
+    }
+    if(! session->recvq[1].base && ! session->throttled){
         if(! session->read_active){
             r = stream_resume_read(session);
             if(! r){
@@ -156,6 +268,8 @@ stream_start_read(msck_session_t* session){
     session->recvq[0].base = 0;
     session->recvq[1].base = 0;
     session->readhead = 0;
+    session->budget_reads = 0;
+    session->budget_bytes = 0;
     return stream_resume_read(session);
 }
 
@@ -176,16 +290,20 @@ cb_write(uv_write_t* req, int status){
     ctx = t->ctx;
     ensure_in_loop(ctx);
     free(t);
+    if(s->session_state == SESSION_CLOSING){
+        /* Cancelled by msck_session_destroy */
+        return;
+    }
     if(status){
         s->session_state = SESSION_DEFUNCT;
-        ctx->cb(ctx, MSCK_EVENT_TYPE_SESSION_SEND_RESULT,
-                MSCK_ERROR_BACKEND, s,
-                0, status, ctx->data, s->data);
+        ctx_event(ctx, MSCK_EVENT_TYPE_SESSION_SEND_RESULT,
+                  MSCK_ERROR_BACKEND, s,
+                  0, status, ctx->data, s->data);
     }else{
         s->session_state = SESSION_IDLE;
-        ctx->cb(ctx, MSCK_EVENT_TYPE_SESSION_SEND_RESULT,
-                MSCK_SUCCESS, s,
-                0, 0, ctx->data, s->data);
+        ctx_event(ctx, MSCK_EVENT_TYPE_SESSION_SEND_RESULT,
+                  MSCK_SUCCESS, s,
+                  0, 0, ctx->data, s->data);
     }
 }
 
@@ -195,14 +313,29 @@ msck_session_write(msck_ctx_t* ctx, msck_session_t* session,
     char* p;
     struct send_task* t;
     int r;
-    if(session->session_type == MSCK_SESSION_TYPE_STREAM){
+    size_t wirelen;
+    if(session->session_type == MSCK_SESSION_TYPE_STREAM
+       || session->session_type == MSCK_SESSION_TYPE_TLS_STREAM){
         if(session->session_state != SESSION_IDLE){
             return MSCK_ERROR_BUSY;
         }
         if(datalen > ((size_t)SSIZE_MAX + sizeof(struct send_task))){
             return MSCK_ERROR_INVALID_ARGUMENT;
         }
-        p = malloc(sizeof(struct send_task) + datalen);
+        if(session->tls && ! msck_tls_tx_offloaded(session)){
+            /* Send TLS records instead */
+            r = msck_tls_encrypt(session, data, datalen,
+                                 sizeof(struct send_task), &p, &wirelen);
+            if(r){
+                return r;
+            }
+        }else{
+            p = malloc(sizeof(struct send_task) + datalen);
+            if(p){
+                memcpy(p + sizeof(struct send_task), data, datalen);
+            }
+            wirelen = datalen;
+        }
         t = (struct send_task *)p;
         if(! t){
             return MSCK_ERROR_BACKEND;
@@ -210,8 +343,7 @@ msck_session_write(msck_ctx_t* ctx, msck_session_t* session,
         t->ctx = ctx;
         t->s = session;
         t->buf.base = p + sizeof(struct send_task);
-        memcpy(t->buf.base, data, datalen);
-        t->buf.len = datalen;
+        t->buf.len = wirelen;
         session->session_state = SESSION_ACTIVE;
         r = uv_write(&session->req.write, &session->handle.stream, 
                      &t->buf, 1, cb_write);
@@ -227,6 +359,28 @@ msck_session_write(msck_ctx_t* ctx, msck_session_t* session,
     }
 }
 
+static void
+cb_close_reject(uv_handle_t* handle){
+    free(handle);
+}
+
+static void
+accept_reject(msck_ctx_t* ctx, msck_session_t* listener){
+    /* Drop the pending connection. libuv stops polling the listener
+     * until it has been uv_accept'ed, so it cannot be left there */
+    uv_tcp_t* h;
+    h = malloc(sizeof(uv_tcp_t));
+    if(! h){
+        return;
+    }
+    if(uv_tcp_init(&ctx->loop, h)){
+        free(h);
+        return;
+    }
+    (void)uv_accept(&listener->handle.stream, (uv_stream_t*)h);
+    uv_close((uv_handle_t*)h, cb_close_reject);
+}
+
 int /* MSCK error */
 msck_session_accept(msck_ctx_t* ctx, msck_session_t* session, uintptr_t data,
                     msck_session_t** out_newsession){
@@ -234,10 +388,12 @@ msck_session_accept(msck_ctx_t* ctx, msck_session_t* session, uintptr_t data,
     int sid;
     int r;
 
-    if(session->session_type == MSCK_SESSION_TYPE_STREAM_SERVER){
+    if(session->session_type == MSCK_SESSION_TYPE_STREAM_SERVER
+       || session->session_type == MSCK_SESSION_TYPE_TLS_STREAM_SERVER){
         /* Pick up a free session */
         sid = ctx->queue_free;
         if(sid < 0){
+            accept_reject(ctx, session);
             return MSCK_ERROR_MAX_SESSION;
         }
         s2 = &ctx->sessions[sid];
@@ -246,21 +402,40 @@ msck_session_accept(msck_ctx_t* ctx, msck_session_t* session, uintptr_t data,
         s2->port1 = 0;
         s2->data = data;
 
+        s2->tls = 0;
         s2->session_type = MSCK_SESSION_TYPE_STREAM;
         s2->session_state = SESSION_IDLE;
+        if(session->session_type == MSCK_SESSION_TYPE_TLS_STREAM_SERVER){
+            r = msck_tls_session_init(ctx, s2, 1, 0, 0, 0, 0);
+            if(r){
+                free_session(ctx, s2);
+                accept_reject(ctx, session);
+                return r;
+            }
+            /* CREATE_RESULT will be reported after handshake */
+            s2->session_type = MSCK_SESSION_TYPE_TLS_STREAM;
+            s2->session_state = SESSION_CONNECTING;
+        }
         r = uv_tcp_init(&ctx->loop, &s2->handle.tcp);
         if(r){
             free_session(ctx, s2);
+            accept_reject(ctx, session);
             return MSCK_ERROR_BACKEND;
         }
+        s2->handle_valid = 1;
+        s2->handle.tcp.data = s2;
 
         r = uv_accept(&session->handle.stream, &s2->handle.stream);
         if(r){
-            free_session(ctx, s2);
+            release_session(ctx, s2);
             return MSCK_ERROR_BACKEND;
         }
         /* FIXME: Handle error here..? */
         (void)stream_start_read(s2);
+        *out_newsession = s2;
+        if(s2->tls){
+            msck_tls_start(ctx, s2);
+        }
         return MSCK_SUCCESS;
     }else{
         return MSCK_ERROR_INVALID_ARGUMENT;
@@ -278,14 +453,24 @@ cb_start_tcp(uv_connect_t* req, int status){
     ctx = loop->data;
     ensure_in_loop(ctx);
 
+    if(s->session_state == SESSION_CLOSING){
+        /* Cancelled by msck_session_destroy */
+        return;
+    }
     if(status){
         s->session_state = SESSION_DEFUNCT;
-        ctx->cb(ctx, MSCK_EVENT_TYPE_SESSION_CREATE_RESULT,
-                MSCK_ERROR_BACKEND, s, 0, status, ctx->data, s->data);
+        ctx_event(ctx, MSCK_EVENT_TYPE_SESSION_CREATE_RESULT,
+                  MSCK_ERROR_BACKEND, s, 0, status, ctx->data, s->data);
+    }else if(s->tls){
+        /* CREATE_RESULT will be reported after handshake */
+        (void)stream_start_read(s);
+        msck_tls_start(ctx, s);
     }else{
         s->session_state = SESSION_IDLE;
-        ctx->cb(ctx, MSCK_EVENT_TYPE_SESSION_CREATE_RESULT,
-                MSCK_SUCCESS, s, 0, 0, ctx->data, s->data);
+        /* FIXME: Handle error here..? */
+        (void)stream_start_read(s);
+        ctx_event(ctx, MSCK_EVENT_TYPE_SESSION_CREATE_RESULT,
+                  MSCK_SUCCESS, s, 0, 0, ctx->data, s->data);
     }
 }
 
@@ -297,8 +482,10 @@ start_tcp(msck_ctx_t* ctx, msck_session_t* s, const struct sockaddr* addr,
     if(r){
         goto uv_fail;
     }
+    s->handle_valid = 1;
     s->handle.tcp.data = s;
     s->session_state = SESSION_CONNECTING;
+    s->req.tcp_connect.data = s;
     r = uv_tcp_connect(&s->req.tcp_connect, &s->handle.tcp,
                        addr, cb_start_tcp);
     if(r){
@@ -310,8 +497,8 @@ start_tcp(msck_ctx_t* ctx, msck_session_t* s, const struct sockaddr* addr,
 uv_fail:
     if(! allowfail){
         s->session_state = SESSION_DEFUNCT;
-        ctx->cb(ctx, MSCK_EVENT_TYPE_SESSION_CREATE_RESULT,
-                MSCK_ERROR_BACKEND, s, 0, r, ctx->data, s->data);
+        ctx_event(ctx, MSCK_EVENT_TYPE_SESSION_CREATE_RESULT,
+                  MSCK_ERROR_BACKEND, s, 0, r, ctx->data, s->data);
     }
     return MSCK_ERROR_BACKEND;
 }
@@ -328,11 +515,11 @@ cb_tcp_listen(uv_stream_t* stream, int status){
 
     if(status){
         s->session_state = SESSION_DEFUNCT;
-        ctx->cb(ctx, MSCK_EVENT_TYPE_SESSION_TERMINATE,
-                MSCK_ERROR_BACKEND, s, 0, status, ctx->data, s->data);
+        ctx_event(ctx, MSCK_EVENT_TYPE_SESSION_TERMINATE,
+                  MSCK_ERROR_BACKEND, s, 0, status, ctx->data, s->data);
     }else{
-        ctx->cb(ctx, MSCK_EVENT_TYPE_SESSION_INCOMING,
-                MSCK_SUCCESS, s, 0, 0, ctx->data, s->data);
+        ctx_event(ctx, MSCK_EVENT_TYPE_SESSION_INCOMING,
+                  MSCK_SUCCESS, s, 0, 0, ctx->data, s->data);
     }
 }
 
@@ -344,6 +531,7 @@ start_tcp_listen(msck_ctx_t* ctx, msck_session_t* s,
     if(r){
         goto uv_fail;
     }
+    s->handle_valid = 1;
     s->handle.tcp.data = s;
     s->session_state = SESSION_CONNECTING;
     r = uv_tcp_bind(&s->handle.tcp, addr, 0); /* FIXME: UV_TCP_IPV6ONLY */
@@ -359,8 +547,8 @@ start_tcp_listen(msck_ctx_t* ctx, msck_session_t* s,
 
 uv_fail:
     if(! allowfail){
-        ctx->cb(ctx, MSCK_EVENT_TYPE_SESSION_CREATE_RESULT,
-                MSCK_ERROR_BACKEND, s, 0, r, ctx->data, s->data);
+        ctx_event(ctx, MSCK_EVENT_TYPE_SESSION_CREATE_RESULT,
+                  MSCK_ERROR_BACKEND, s, 0, r, ctx->data, s->data);
     }
     return MSCK_ERROR_BACKEND;
 }
@@ -387,6 +575,19 @@ addr_fillport(int port, union addr* addr){
     }
 }
 
+/* Numeric host literal of family (or AF_UNSPEC) into addr, port 0 */
+static int /* bool */
+addr_parse_literal(int family, const char* name, union addr* addr){
+    memset(addr, 0, sizeof(union addr));
+    if(family != AF_INET6 && ! uv_ip4_addr(name, 0, &addr->sin)){
+        return 1;
+    }
+    if(family != AF_INET && ! uv_ip6_addr(name, 0, &addr->sin6)){
+        return 1;
+    }
+    return 0;
+}
+
 static int /* MSCK error */
 name_resolved(msck_ctx_t* ctx, msck_session_t* s, const struct sockaddr* addr,
               int allowfail){
@@ -394,8 +595,10 @@ name_resolved(msck_ctx_t* ctx, msck_session_t* s, const struct sockaddr* addr,
     /* Start connection */
     switch(s->session_type){
         case MSCK_SESSION_TYPE_STREAM:
+        case MSCK_SESSION_TYPE_TLS_STREAM:
             return start_tcp(ctx, s, addr, allowfail);
         case MSCK_SESSION_TYPE_STREAM_SERVER:
+        case MSCK_SESSION_TYPE_TLS_STREAM_SERVER:
             return start_tcp_listen(ctx, s, addr, allowfail);
         case MSCK_SESSION_TYPE_DATAGRAM:
             break;
@@ -403,9 +606,9 @@ name_resolved(msck_ctx_t* ctx, msck_session_t* s, const struct sockaddr* addr,
             if(! allowfail){
                 /* Unknown session_type for us */
                 s->session_state = SESSION_DEFUNCT;
-                ctx->cb(ctx, MSCK_EVENT_TYPE_SESSION_CREATE_RESULT,
-                        MSCK_ERROR_INVALID_ARGUMENT,
-                        s, 0, 0, ctx->data, s->data);
+                ctx_event(ctx, MSCK_EVENT_TYPE_SESSION_CREATE_RESULT,
+                          MSCK_ERROR_INVALID_ARGUMENT,
+                          s, 0, 0, ctx->data, s->data);
             }
             break;
     }
@@ -426,13 +629,21 @@ cb_gai(uv_getaddrinfo_t* req, int status,
     ctx = loop->data;
     ensure_in_loop(ctx);
 
+    if(s->session_state == SESSION_CLOSING){
+        /* Cancelled by msck_session_destroy */
+        if(! status){
+            uv_freeaddrinfo(res);
+        }
+        free_session(ctx, s);
+        return;
+    }
     if(status){
         /* Invoke error callback */
         s->session_state = SESSION_DEFUNCT;
-        ctx->cb(ctx, MSCK_EVENT_TYPE_SESSION_CREATE_RESULT,
-                MSCK_ERROR_NAME_LOOKUP, s, 0,
-                status /* FIXME: decode backend error? */, 
-                ctx->data, s->data);
+        ctx_event(ctx, MSCK_EVENT_TYPE_SESSION_CREATE_RESULT,
+                  MSCK_ERROR_NAME_LOOKUP, s, 0,
+                  status /* FIXME: decode backend error? */, 
+                  ctx->data, s->data);
     }else{
         /* Complete connection */
         switch(res->ai_family){
@@ -445,10 +656,10 @@ cb_gai(uv_getaddrinfo_t* req, int status,
             default:
                 /* Invoke error callback */
                 s->session_state = SESSION_DEFUNCT;
-                ctx->cb(ctx, MSCK_EVENT_TYPE_SESSION_CREATE_RESULT,
-                        MSCK_ERROR_NAME_LOOKUP,
-                        s, 0, status /* FIXME: decode backend error? */, 
-                        ctx->data, s->data);
+                ctx_event(ctx, MSCK_EVENT_TYPE_SESSION_CREATE_RESULT,
+                          MSCK_ERROR_NAME_LOOKUP,
+                          s, 0, status /* FIXME: decode backend error? */, 
+                          ctx->data, s->data);
                 break;
         }
         uv_freeaddrinfo(res);
@@ -468,14 +679,27 @@ msck_session_create(msck_ctx_t* ctx,
     int require_gai;
     int require_start_read;
     int r;
+    int family;
     union addr addr;
-    char* namebuf;
+    struct addrinfo hints;
+    const char* host;
+    const void* ip;
+    size_t iplen;
+    char namebuf[256]; /* DNS names are at most 253 octets */
 
     /* Check arguments first */
     switch(st){
         case MSCK_SESSION_TYPE_STREAM:
+        case MSCK_SESSION_TYPE_TLS_STREAM:
             require_start_read = 1;
             break;
+        case MSCK_SESSION_TYPE_TLS_STREAM_SERVER:
+            if(! msck_tls_server_ready(ctx)){
+                /* Every accept would fail */
+                return MSCK_ERROR_INVALID_ARGUMENT;
+            }
+            require_start_read = 0;
+            break;
         case MSCK_SESSION_TYPE_STREAM_SERVER:
         case MSCK_SESSION_TYPE_DATAGRAM:
             require_start_read = 0;
@@ -485,6 +709,9 @@ msck_session_create(msck_ctx_t* ctx,
             return MSCK_ERROR_UNIMPLEMENTED;
     }
 
+    host = 0;
+    ip = 0;
+    iplen = 0;
     switch(nt){
         case MSCK_NAME_TYPE_IPV4:
             memset(&addr, 0, sizeof(addr));
@@ -495,6 +722,8 @@ msck_session_create(msck_ctx_t* ctx,
             addr.sin.sin_family = AF_INET;
             memcpy(&addr.sin.sin_addr, name, namelen);
             addr_fillport(arg0, &addr);
+            ip = &addr.sin.sin_addr;
+            iplen = 4;
             break;
         case MSCK_NAME_TYPE_IPV6:
             memset(&addr, 0, sizeof(addr));
@@ -505,13 +734,43 @@ msck_session_create(msck_ctx_t* ctx,
             addr.sin6.sin6_family = AF_INET6;
             memcpy(&addr.sin6.sin6_addr, name, namelen);
             addr_fillport(arg0, &addr);
+            ip = &addr.sin6.sin6_addr;
+            iplen = 16;
             break;
         case MSCK_NAME_TYPE_DNS:
-            require_gai = 1;
-            break;
-
         case MSCK_NAME_TYPE_DNS_IPV4:
         case MSCK_NAME_TYPE_DNS_IPV6:
+            if(namelen >= sizeof(namebuf)){
+                return MSCK_ERROR_INVALID_ARGUMENT;
+            }
+            memcpy(namebuf, name, namelen);
+            namebuf[namelen] = 0;
+            if(nt == MSCK_NAME_TYPE_DNS_IPV4){
+                family = AF_INET;
+            }else if(nt == MSCK_NAME_TYPE_DNS_IPV6){
+                family = AF_INET6;
+            }else{
+                family = AF_UNSPEC;
+            }
+            if(addr_parse_literal(family, namebuf, &addr)){
+                /* Literal address; connect without a resolver round trip.
+                 * Literals of the other family still go to the resolver
+                 * so they fail the same way as any unresolvable name. */
+                require_gai = 0;
+                addr_fillport(arg0, &addr);
+                if(addr.sa.sa_family == AF_INET){
+                    ip = &addr.sin.sin_addr;
+                    iplen = 4;
+                }else{
+                    ip = &addr.sin6.sin6_addr;
+                    iplen = 16;
+                }
+            }else{
+                require_gai = 1;
+                host = name;
+            }
+            break;
+
         default:
             return MSCK_ERROR_UNIMPLEMENTED;
     }
@@ -534,20 +793,27 @@ msck_session_create(msck_ctx_t* ctx,
     s->port0 = arg0;
     s->port1 = arg1;
     s->data = data;
+    s->handle_valid = 0;
+    s->tls = 0;
 
-    if(require_gai){
-        namebuf = malloc(namelen+1);
-        if(! namebuf){
+    if(st == MSCK_SESSION_TYPE_TLS_STREAM){
+        r = msck_tls_session_init(ctx, s, 0, host, namelen, ip, iplen);
+        if(r){
             free_session(ctx, s);
-            return MSCK_ERROR_BACKEND;
+            return r;
         }
-        memset(namebuf, 0, namelen+1);
-        memcpy(namebuf, name, namelen);
+    }
+
+    if(require_gai){
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = family;
+        hints.ai_socktype = (st == MSCK_SESSION_TYPE_DATAGRAM) ?
+            SOCK_DGRAM : SOCK_STREAM;
         s->session_state = SESSION_IN_GAI;
         s->req.gai.data = s;
+        /* uv_getaddrinfo copies namebuf and hints */
         r = uv_getaddrinfo(&ctx->loop, &s->req.gai, cb_gai, namebuf, NULL,
-                           NULL);
-        free(namebuf);
+                           &hints);
         if(r){
             free_session(ctx, s);
             return MSCK_ERROR_BACKEND;
@@ -557,21 +823,48 @@ msck_session_create(msck_ctx_t* ctx,
     }else{
         r = name_resolved(ctx, s, &addr.sa, 1);
         if(r){
-            free_session(ctx, s);
+            release_session(ctx, s);
             return r;
         }else{
             *out_session = s;
         }
     }
     if(require_start_read){
-        stream_start_read(s);
+        /* Stream read will be started on connect (cb_start_tcp) */
+        s->read_active = 0;
+        s->recvq[0].base = 0;
+        s->recvq[1].base = 0;
+        s->readhead = 0;
     }
     return MSCK_SUCCESS;
 }
 
 void 
 msck_session_destroy(msck_ctx_t* ctx, msck_session_t* session){
-
+    switch(session->session_state){
+        case SESSION_FREE:
+        case SESSION_CLOSING:
+            /* Already destroyed */
+            return;
+        case SESSION_IN_GAI:
+            /* cb_gai will return the session to the free list */
+            session->session_state = SESSION_CLOSING;
+            (void)uv_cancel((uv_req_t*)&session->req.gai);
+            return;
+        default:
+            break;
+    }
+    if(session->session_type == MSCK_SESSION_TYPE_STREAM
+       || session->session_type == MSCK_SESSION_TYPE_TLS_STREAM){
+        free(session->recvq[0].base);
+        free(session->recvq[1].base);
+        session->recvq[0].base = 0;
+        session->recvq[1].base = 0;
+        session->read_active = 0;
+    }
+    /* Pending connect/write callbacks will be called with UV_ECANCELED
+     * before cb_close_session; they check for SESSION_CLOSING */
+    release_session(ctx, session);
 }
 
 /* 
@@ -583,6 +876,7 @@ predispatch(uv_prepare_t* prepare){
     uv_loop_t* loop;
     msck_ctx_t* ctx;
     msck_session_t* s;
+    int id;
     loop = prepare->loop;
     ctx = loop->data;
 
@@ -592,12 +886,33 @@ predispatch(uv_prepare_t* prepare){
         return;
     }
 
+    /* New iteration: read budgets start over */
+    ctx->iter++;
+
     /* Check for pre-start UDP sessions */
     while(ctx->queue_udp_ready >= 0){
         s = &ctx->sessions[ctx->queue_udp_ready];
         ctx->queue_udp_ready = s->next;
         /* Invoke UDP connect callback */
     }
+
+    /* Resume sessions throttled by read budget, in throttle order */
+    id = ctx->queue_throttled;
+    if(id >= 0){
+        ctx->queue_throttled = -1;
+        uv_unref((uv_handle_t*)&ctx->prepare);
+    }
+    while(id >= 0){
+        s = &ctx->sessions[id];
+        id = s->next_throttled;
+        s->throttled = 0;
+        if((s->session_state == SESSION_IDLE
+            || s->session_state == SESSION_ACTIVE)
+           && ! s->read_active && ! s->recvq[1].base){
+            ctx->stats.budget_resumes++;
+            (void)stream_resume_read(s);
+        }
+    }
 }
 
 
@@ -612,54 +927,148 @@ msck_ctx_create_default(msck_ctx_callback_t cb,
         res->sessions[i].id = i;
         res->sessions[i].next = (i+1);
         res->sessions[i].session_state = SESSION_FREE;
+        res->sessions[i].handle_valid = 0;
+        res->sessions[i].tls = 0;
+        res->sessions[i].throttled = 0;
+        res->sessions[i].budget_iter = 0;
         res->sessions[i].loop = &res->loop;
     }
     res->sessions[MAX_SESSIONS-1].next = -1;
     res->queue_udp_ready = -1;
     res->queue_free = 0;
+    res->tls = 0;
     res->data = data;
     res->cb = cb;
     res->in_destroy = 0;
     res->in_loop = 0;
     res->done = 0;
+    res->events = 0;
+    res->busy_poll_ns = 0;
+    res->iter = 0;
+    res->budget_reads = 0;
+    res->budget_bytes = 0;
+    res->queue_throttled = -1;
+    res->queue_throttled_tail = -1;
+    memset(&res->stats, 0, sizeof(res->stats));
     *out_ctx = res;
     uv_loop_init(&res->loop);
     res->loop.data = res;
     uv_prepare_init(&res->loop, &res->prepare);
     uv_prepare_start(&res->prepare, predispatch);
+    /* Don't let predispatch alone keep the loop alive (step_ex pending) */
+    uv_unref((uv_handle_t*)&res->prepare);
     return 0;
 }
 
-int
-msck_ctx_destory(msck_ctx_t* ctx){
+void
+msck_ctx_destroy(msck_ctx_t* ctx){
+    int i;
     if(! ctx->in_loop){
-        uv_loop_close(&ctx->loop);
+        ctx->in_destroy = 1;
+        for(i=0;i!=MAX_SESSIONS;i++){
+            msck_session_destroy(ctx, &ctx->sessions[i]);
+        }
+        uv_close((uv_handle_t*)&ctx->prepare, NULL);
+        /* Run close callbacks (and cancelled requests) to completion;
+         * they see SESSION_CLOSING and dispatch no events */
+        ctx->in_loop = 1;
+        while(uv_run(&ctx->loop, UV_RUN_DEFAULT)){
+        }
+        ctx->in_loop = 0;
+        if(uv_loop_close(&ctx->loop)){
+            /* Handle we don't own; freeing a live loop would be worse */
+            abort();
+        }
+        msck_tls_ctx_free(ctx);
         free(ctx);
-        return 0;
+        return;
     }
     if(! ctx->in_destroy){
         ctx->in_destroy = 1;
-        return 0;
+        return;
     }
     /* Something wrong */
-    return 0;
 }
 
-void /* FIXME: Should return runme status? */
-msck_ctx_step(msck_ctx_t* ctx, int waitok){
+int
+msck_ctx_backend_fd(msck_ctx_t* ctx){
+    return uv_backend_fd(&ctx->loop);
+}
+
+int
+msck_ctx_backend_timeout(msck_ctx_t* ctx){
+    if(ctx->queue_throttled >= 0){
+        /* predispatch has to resume throttled sessions; their fds may
+         * not be polled at all */
+        return 0;
+    }
+    return uv_backend_timeout(&ctx->loop);
+}
+
+int /* MSCK error */
+msck_ctx_set_busy_poll(msck_ctx_t* ctx, uint32_t budget_us){
+    ctx->busy_poll_ns = (uint64_t)budget_us * 1000;
+    return MSCK_SUCCESS;
+}
+
+int /* MSCK error */
+msck_ctx_set_read_budget(msck_ctx_t* ctx, uint32_t max_reads,
+                         size_t max_bytes){
+    ctx->budget_reads = max_reads;
+    ctx->budget_bytes = max_bytes;
+    return MSCK_SUCCESS;
+}
+
+int /* MSCK error */
+msck_ctx_get_stats(msck_ctx_t* ctx, msck_ctx_stats_t* out_stats){
+    *out_stats = ctx->stats;
+    return MSCK_SUCCESS;
+}
+
+int /* MSCK error */
+msck_ctx_step_ex(msck_ctx_t* ctx, int waitok,
+                 int* out_pending, int* out_events){
+    int pending;
+    uint64_t deadline;
     if(ctx->in_loop){
         /* I'm not reentrant: Something wrong */
-        return;
+        return MSCK_ERROR_BUSY;
     }
     if(ctx->in_destroy){
         /* Do nothing for in_destroy loop */
-        return;
+        return MSCK_ERROR_INVALID_ARGUMENT;
     }
 
     /* Single step */
     ctx->in_loop = 1;
-    uv_run(&ctx->loop, waitok ? UV_RUN_ONCE : UV_RUN_NOWAIT);
+    ctx->events = 0;
+    if(waitok && ctx->busy_poll_ns){
+        /* Spin on the backend before paying for a blocking wakeup */
+        deadline = uv_hrtime() + ctx->busy_poll_ns;
+        do{
+            pending = uv_run(&ctx->loop, UV_RUN_NOWAIT);
+        }while(pending && ! ctx->events && uv_hrtime() < deadline);
+        if(! pending || ctx->events){
+            goto done;
+        }
+    }
+    pending = uv_run(&ctx->loop, waitok ? UV_RUN_ONCE : UV_RUN_NOWAIT);
+
+done:
     ctx->in_loop = 0;
+
+    if(out_pending){
+        *out_pending = pending;
+    }
+    if(out_events){
+        *out_events = ctx->events;
+    }
+    return MSCK_SUCCESS;
+}
+
+void
+msck_ctx_step(msck_ctx_t* ctx, int waitok){
+    (void)msck_ctx_step_ex(ctx, waitok, 0, 0);
 }
 
 
@@ -11,7 +11,10 @@ struct msck_session_s {
         SESSION_IN_GAI,
 
         /* Fail */
-        SESSION_DEFUNCT
+        SESSION_DEFUNCT,
+
+        /* Waiting for uv_close (or cancelled GAI) callback */
+        SESSION_CLOSING
     } session_state;
     uv_loop_t* loop;
     union {
@@ -20,12 +23,14 @@ struct msck_session_s {
         uv_udp_t udp;
         uv_tcp_t tcp;
     } handle;
+    int handle_valid;
     union {
         /* req */
         uv_getaddrinfo_t gai;
         uv_connect_t tcp_connect;
         uv_write_t write;
     } req;
+    struct msck_tls_s* tls; /* TLS sessions only */
     int port0;
     int port1;
     int read_active;
@@ -33,6 +38,13 @@ struct msck_session_s {
     msck_session_type_t session_type;
     uv_buf_t recvq[2];
     size_t readhead;
+
+    /* Read budget (see stream_charge_budget) */
+    uint64_t budget_iter;
+    uint32_t budget_reads;
+    size_t budget_bytes;
+    int throttled;
+    int next_throttled;
 };
 
 
@@ -45,9 +57,47 @@ struct msck_ctx_s {
     int done;
     int in_destroy;
     int in_loop;
+    int events; /* Dispatched in current step */
+    uint64_t busy_poll_ns;
+
+    uint64_t iter; /* Loop iterations, for read budgets */
+    uint32_t budget_reads;
+    size_t budget_bytes;
+    int queue_throttled;
+    int queue_throttled_tail;
+    msck_ctx_stats_t stats;
+
+    struct msck_tls_ctx_s* tls;
 
     int queue_udp_ready;
     int queue_free;
     msck_session_t sessions[MAX_SESSIONS];
 };
 
+
+/* libuv-worker.c */
+void ensure_in_loop(msck_ctx_t* ctx);
+void ctx_event(msck_ctx_t* ctx, msck_event_t type, msck_error_t err,
+               msck_session_t* s, const char* buf, uintptr_t arg0,
+               uintptr_t data_ctx, uintptr_t data_session);
+void stream_queue_read(msck_ctx_t* ctx, msck_session_t* s,
+                       char* base, size_t len, int notify);
+void stream_terminate(msck_ctx_t* ctx, msck_session_t* s,
+                      msck_error_t err, uintptr_t arg0);
+
+/* libuv-tls.c */
+int msck_tls_server_ready(msck_ctx_t* ctx);
+/* Client peer identity: host name, or binary address (4 or 16 bytes) */
+int msck_tls_session_init(msck_ctx_t* ctx, msck_session_t* s, int server,
+                          const char* host, size_t hostlen,
+                          const void* ip, size_t iplen);
+void msck_tls_session_free(msck_session_t* s);
+void msck_tls_ctx_free(msck_ctx_t* ctx);
+void msck_tls_start(msck_ctx_t* ctx, msck_session_t* s);
+void msck_tls_feed(msck_ctx_t* ctx, msck_session_t* s,
+                   const char* buf, size_t len);
+void msck_tls_pump(msck_ctx_t* ctx, msck_session_t* s, int notify);
+int msck_tls_encrypt(msck_session_t* s, const char* data, size_t datalen,
+                     size_t headroom, char** out, size_t* outlen);
+int msck_tls_rx_offloaded(msck_session_t* s);
+int msck_tls_tx_offloaded(msck_session_t* s);
@@ -0,0 +1,409 @@
+/*
+ * msck-tls-test: TLS stream sessions against a local self-signed server
+ *
+ * Generates throwaway self-signed certificates, then for both kTLS and
+ * MSCK_TLS_DISABLE_KTLS:
+ *
+ *  - handshakes and echoes a payload with peer verification, connecting
+ *    by binary IPV4 address, DNS host name and numeric DNS name
+ *  - rejects a trusted certificate issued for another name, again for
+ *    each name type, with exactly one CREATE_RESULT per failed session
+ *
+ * and checks that a TLS listener without a server certificate is refused.
+ * Exits non-zero on the first failure.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <openssl/evp.h>
+#include <openssl/ec.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+#include "minisock.h"
+
+#define TEST_PORT 6971
+#define PAYLOAD_SIZE (256*1024)
+#define MAX_PEERS 4
+
+static char tmpdir[] = "/tmp/msck-tls-XXXXXX";
+static char good_cert[64], good_key[64];
+static char evil_cert[64], evil_key[64];
+
+/*
+ * Certificates
+ */
+
+static EVP_PKEY*
+gen_key(void){
+    EVP_PKEY_CTX* pctx;
+    EVP_PKEY* pkey;
+    pkey = NULL;
+    pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    if(pctx && EVP_PKEY_keygen_init(pctx) > 0
+       && EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx,
+                                                 NID_X9_62_prime256v1) > 0){
+        (void)EVP_PKEY_keygen(pctx, &pkey);
+    }
+    EVP_PKEY_CTX_free(pctx);
+    return pkey;
+}
+
+static int
+add_ext(X509* x, int nid, const char* value){
+    X509V3_CTX v3;
+    X509_EXTENSION* ext;
+    int r;
+    X509V3_set_ctx(&v3, x, x, NULL, NULL, 0);
+    ext = X509V3_EXT_conf_nid(NULL, &v3, nid, value);
+    if(! ext){
+        return 0;
+    }
+    r = X509_add_ext(x, ext, -1);
+    X509_EXTENSION_free(ext);
+    return r;
+}
+
+static int
+write_cert(const char* san, const char* certpath, const char* keypath){
+    EVP_PKEY* pkey;
+    X509* x;
+    X509_NAME* n;
+    FILE* fp;
+    int ok;
+    pkey = gen_key();
+    x = X509_new();
+    ok = pkey && x
+        && X509_set_version(x, 2)
+        && ASN1_INTEGER_set(X509_get_serialNumber(x), 1)
+        && X509_gmtime_adj(X509_getm_notBefore(x), -3600)
+        && X509_gmtime_adj(X509_getm_notAfter(x), 86400)
+        && X509_set_pubkey(x, pkey);
+    if(ok){
+        n = X509_get_subject_name(x);
+        ok = X509_NAME_add_entry_by_txt(n, "CN", MBSTRING_ASC,
+                                        (const unsigned char*)"msck-test",
+                                        -1, -1, 0)
+            && X509_set_issuer_name(x, n)
+            && add_ext(x, NID_basic_constraints, "critical,CA:TRUE")
+            && add_ext(x, NID_subject_alt_name, san)
+            && X509_sign(x, pkey, EVP_sha256());
+    }
+    if(ok){
+        fp = fopen(certpath, "w");
+        ok = fp && PEM_write_X509(fp, x);
+        if(fp){
+            fclose(fp);
+        }
+    }
+    if(ok){
+        fp = fopen(keypath, "w");
+        ok = fp && PEM_write_PrivateKey(fp, pkey, NULL, NULL, 0, NULL, NULL);
+        if(fp){
+            fclose(fp);
+        }
+    }
+    X509_free(x);
+    EVP_PKEY_free(pkey);
+    return ok;
+}
+
+/*
+ * Echo
+ */
+
+struct peer {
+    int listener;
+    int client;
+    msck_session_t* session;
+    int creates;
+    msck_error_t create_err;
+    int terminates;
+    int busy;
+    char* buf; /* Server: received, not yet echoed. Client: echo */
+    size_t len;
+    size_t sent;
+};
+
+static struct peer peers[MAX_PEERS];
+static char* payload;
+
+static struct peer*
+peer_new(void){
+    int i;
+    for(i=0;i!=MAX_PEERS;i++){
+        if(! peers[i].session && ! peers[i].listener && ! peers[i].client){
+            memset(&peers[i], 0, sizeof(struct peer));
+            peers[i].buf = malloc(PAYLOAD_SIZE);
+            return &peers[i];
+        }
+    }
+    return 0;
+}
+
+static void
+peer_flush(msck_ctx_t* ctx, struct peer* p){
+    size_t count;
+    if(p->busy || p->sent == p->len){
+        return;
+    }
+    if(! msck_session_write(ctx, p->session, p->buf + p->sent,
+                            p->len - p->sent, &count)){
+        p->busy = 1;
+        p->sent += count;
+    }
+}
+
+static void
+peer_drain(msck_ctx_t* ctx, struct peer* p){
+    size_t count;
+    for(;;){
+        if(p->len == PAYLOAD_SIZE){
+            return;
+        }
+        if(msck_session_read(ctx, p->session, p->buf + p->len,
+                             PAYLOAD_SIZE - p->len, &count) || ! count){
+            return;
+        }
+        p->len += count;
+    }
+}
+
+static void
+test_cb(msck_ctx_t* ctx, msck_event_t type, msck_error_t err,
+        msck_session_t* session, const char* buf, uintptr_t arg0,
+        uintptr_t data_ctx, uintptr_t data_session){
+    struct peer* p;
+    struct peer* p2;
+    size_t count;
+    p = (struct peer*)data_session;
+    switch(type){
+        case MSCK_EVENT_TYPE_SESSION_INCOMING:
+            if(p->listener){
+                p2 = peer_new();
+                if(! p2 || msck_session_accept(ctx, session, (uintptr_t)p2,
+                                               &p2->session)){
+                    fprintf(stderr, "accept failed\n");
+                    exit(1);
+                }
+                break;
+            }
+            peer_drain(ctx, p);
+            if(! p->client){
+                peer_flush(ctx, p);
+            }
+            break;
+        case MSCK_EVENT_TYPE_SESSION_CREATE_RESULT:
+            p->creates++;
+            p->create_err = err;
+            if(! err && p->client){
+                if(msck_session_write(ctx, session, payload, PAYLOAD_SIZE,
+                                      &count)){
+                    fprintf(stderr, "client write failed\n");
+                    exit(1);
+                }
+                p->busy = 1;
+            }
+            break;
+        case MSCK_EVENT_TYPE_SESSION_SEND_RESULT:
+            p->busy = 0;
+            if(! p->client){
+                peer_flush(ctx, p);
+            }
+            break;
+        case MSCK_EVENT_TYPE_SESSION_TERMINATE:
+            p->terminates++;
+            break;
+        default:
+            break;
+    }
+}
+
+static void
+run_for(msck_ctx_t* ctx, int ms, const struct peer* until){
+    struct pollfd pfd;
+    struct timespec ts;
+    long long deadline;
+    long long now;
+    int timeout;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    deadline = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000 + ms;
+    for(;;){
+        if(until && (until->creates && (until->create_err
+                                        || until->len == PAYLOAD_SIZE))){
+            return;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        now = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+        if(now >= deadline){
+            return;
+        }
+        timeout = msck_ctx_backend_timeout(ctx);
+        if(timeout < 0 || timeout > deadline - now){
+            timeout = (int)(deadline - now);
+        }
+        pfd.fd = msck_ctx_backend_fd(ctx);
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        (void)poll(&pfd, 1, timeout);
+        msck_ctx_step(ctx, 0);
+    }
+}
+
+/*
+ * Cases
+ */
+
+static int
+run_case(const char* label, int flags, const char* cert, const char* key,
+         msck_name_type_t nt, const char* name, size_t namelen,
+         int expect_ok){
+    msck_ctx_t* ctx;
+    struct peer* listener;
+    struct peer* client;
+    int i;
+    int ok;
+
+    memset(peers, 0, sizeof(peers));
+    msck_ctx_create_default(test_cb, 0, &ctx);
+    if(msck_ctx_tls_config(ctx, cert, key, cert,
+                           flags | MSCK_TLS_VERIFY_PEER)){
+        fprintf(stderr, "%s: tls_config failed\n", label);
+        return 0;
+    }
+    listener = &peers[0];
+    listener->listener = 1;
+    if(msck_session_create(ctx, MSCK_SESSION_TYPE_TLS_STREAM_SERVER,
+                           MSCK_NAME_TYPE_DNS, "127.0.0.1", 9, TEST_PORT, 0,
+                           (uintptr_t)listener, &listener->session)){
+        fprintf(stderr, "%s: listen failed\n", label);
+        return 0;
+    }
+    client = &peers[1];
+    client->client = 1;
+    client->buf = malloc(PAYLOAD_SIZE);
+    if(msck_session_create(ctx, MSCK_SESSION_TYPE_TLS_STREAM, nt,
+                           name, namelen, TEST_PORT, 0,
+                           (uintptr_t)client, &client->session)){
+        fprintf(stderr, "%s: connect failed\n", label);
+        return 0;
+    }
+    run_for(ctx, 5000, client);
+    /* Give late records (alerts, junk) a chance to cause extra events */
+    run_for(ctx, 200, 0);
+
+    if(expect_ok){
+        ok = client->creates == 1 && client->create_err == MSCK_SUCCESS
+            && client->len == PAYLOAD_SIZE
+            && ! memcmp(client->buf, payload, PAYLOAD_SIZE);
+    }else{
+        ok = client->creates == 1 && client->create_err == MSCK_ERROR_TLS
+            && ! client->terminates;
+        for(i=2;i!=MAX_PEERS;i++){
+            if(peers[i].creates > 1 || peers[i].terminates){
+                ok = 0;
+            }
+        }
+    }
+    printf("%s: %s (creates=%d err=%d echoed=%lu)\n", label,
+           ok ? "ok" : "FAILED", client->creates, (int)client->create_err,
+           (unsigned long)client->len);
+
+    msck_ctx_destroy(ctx);
+    for(i=0;i!=MAX_PEERS;i++){
+        free(peers[i].buf);
+    }
+    return ok;
+}
+
+static int
+run_no_server_cert(void){
+    msck_ctx_t* ctx;
+    msck_session_t* s;
+    int r;
+    msck_ctx_create_default(test_cb, 0, &ctx);
+    if(msck_ctx_tls_config(ctx, 0, 0, good_cert, MSCK_TLS_VERIFY_PEER)){
+        return 0;
+    }
+    r = msck_session_create(ctx, MSCK_SESSION_TYPE_TLS_STREAM_SERVER,
+                            MSCK_NAME_TYPE_DNS, "127.0.0.1", 9, TEST_PORT, 0,
+                            0, &s);
+    printf("listener without certificate: %s\n",
+           r == MSCK_ERROR_INVALID_ARGUMENT ? "ok" : "FAILED");
+    msck_ctx_destroy(ctx);
+    return r == MSCK_ERROR_INVALID_ARGUMENT;
+}
+
+static void
+cleanup(void){
+    unlink(good_cert);
+    unlink(good_key);
+    unlink(evil_cert);
+    unlink(evil_key);
+    rmdir(tmpdir);
+}
+
+int
+main(void){
+    static const unsigned char loopback[4] = {127, 0, 0, 1};
+    static const struct {
+        const char* label;
+        int flags;
+    } modes[] = {
+        {"ktls", 0},
+        {"no-ktls", MSCK_TLS_DISABLE_KTLS}
+    };
+    char label[64];
+    int i;
+    int ok;
+
+    if(! mkdtemp(tmpdir)){
+        perror("mkdtemp");
+        return 1;
+    }
+    snprintf(good_cert, sizeof(good_cert), "%s/good.pem", tmpdir);
+    snprintf(good_key, sizeof(good_key), "%s/good.key", tmpdir);
+    snprintf(evil_cert, sizeof(evil_cert), "%s/evil.pem", tmpdir);
+    snprintf(evil_key, sizeof(evil_key), "%s/evil.key", tmpdir);
+    if(! write_cert("DNS:localhost,IP:127.0.0.1", good_cert, good_key)
+       || ! write_cert("DNS:evil.example", evil_cert, evil_key)){
+        fprintf(stderr, "certificate generation failed\n");
+        cleanup();
+        return 1;
+    }
+    payload = malloc(PAYLOAD_SIZE);
+    for(i=0;i!=PAYLOAD_SIZE;i++){
+        payload[i] = (char)(i * 7 + (i >> 10));
+    }
+
+    ok = 1;
+    for(i=0;i!=2 && ok;i++){
+        snprintf(label, sizeof(label), "%s echo ipv4", modes[i].label);
+        ok = ok && run_case(label, modes[i].flags, good_cert, good_key,
+                            MSCK_NAME_TYPE_IPV4, (const char*)loopback, 4, 1);
+        snprintf(label, sizeof(label), "%s echo dns", modes[i].label);
+        ok = ok && run_case(label, modes[i].flags, good_cert, good_key,
+                            MSCK_NAME_TYPE_DNS, "localhost", 9, 1);
+        snprintf(label, sizeof(label), "%s echo literal", modes[i].label);
+        ok = ok && run_case(label, modes[i].flags, good_cert, good_key,
+                            MSCK_NAME_TYPE_DNS, "127.0.0.1", 9, 1);
+        snprintf(label, sizeof(label), "%s wrong name ipv4", modes[i].label);
+        ok = ok && run_case(label, modes[i].flags, evil_cert, evil_key,
+                            MSCK_NAME_TYPE_IPV4, (const char*)loopback, 4, 0);
+        snprintf(label, sizeof(label), "%s wrong name dns", modes[i].label);
+        ok = ok && run_case(label, modes[i].flags, evil_cert, evil_key,
+                            MSCK_NAME_TYPE_DNS, "localhost", 9, 0);
+        snprintf(label, sizeof(label), "%s wrong name literal",
+                 modes[i].label);
+        ok = ok && run_case(label, modes[i].flags, evil_cert, evil_key,
+                            MSCK_NAME_TYPE_DNS, "127.0.0.1", 9, 0);
+    }
+    ok = ok && run_no_server_cert();
+
+    free(payload);
+    cleanup();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,874 @@
+/*
+ * msck-loadgen: Connection-storm load generator for minisock
+ *
+ *  msck-loadgen server [-p port] [-P nports] [-b reads,bytes]
+ *  msck-loadgen client [-a addr] [-p port] [-P nports] [-c conns]
+ *                      [-r connects/sec] [-k closes/sec] [-m size,size,...]
+ *                      [-i think-ms] [-d seconds] [-b reads,bytes]
+ *
+ * Server mode runs an echo server on nports consecutive ports.
+ * Client mode opens and holds -c connections against it (spread across
+ * the ports so we don't run out of loopback ephemeral ports), sends
+ * messages picked from the -m size mix and waits for the echo.
+ * -k closes random established connections and opens replacements.
+ * -b sets the per-session read budget (msck_ctx_set_read_budget).
+ *
+ * Both modes report session-table occupancy, connects/sec, echo latency
+ * percentiles and RSS every second.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+#include "minisock.h"
+
+/* Must match MAX_SESSIONS of the backend */
+#define TABLE_SIZE (64*1024)
+#define MAX_MSG_SIZES 16
+#define RECV_BUF_SIZE (64*1024)
+
+/*
+ * Stats
+ */
+
+/* Log-linear latency histogram in usec (~3% precision) */
+#define LAT_BUCKETS (64 + 32*32)
+
+struct lat_hist {
+    uint64_t count;
+    uint64_t max;
+    uint64_t bucket[LAT_BUCKETS];
+};
+
+static int
+lat_bucket(uint64_t us){
+    int e;
+    int idx;
+    e = 0;
+    while((us >> e) >= 64){
+        e++;
+    }
+    if(e == 0){
+        return (int)us;
+    }
+    idx = 64 + (e-1)*32 + (int)((us >> e) - 32);
+    if(idx >= LAT_BUCKETS){
+        idx = LAT_BUCKETS - 1;
+    }
+    return idx;
+}
+
+static uint64_t
+lat_bucket_value(int idx){
+    int e;
+    if(idx < 64){
+        return idx;
+    }
+    e = (idx - 64) / 32 + 1;
+    return (uint64_t)((idx - 64) % 32 + 32) << e;
+}
+
+static void
+lat_add(struct lat_hist* h, uint64_t us){
+    h->bucket[lat_bucket(us)]++;
+    h->count++;
+    if(us > h->max){
+        h->max = us;
+    }
+}
+
+static void
+lat_merge(struct lat_hist* to, const struct lat_hist* from){
+    int i;
+    for(i=0;i!=LAT_BUCKETS;i++){
+        to->bucket[i] += from->bucket[i];
+    }
+    to->count += from->count;
+    if(from->max > to->max){
+        to->max = from->max;
+    }
+}
+
+static uint64_t
+lat_percentile(const struct lat_hist* h, double pct){
+    uint64_t target;
+    uint64_t acc;
+    int i;
+    if(! h->count){
+        return 0;
+    }
+    target = (uint64_t)(h->count * pct / 100.0);
+    if(target >= h->count){
+        target = h->count - 1;
+    }
+    acc = 0;
+    for(i=0;i!=LAT_BUCKETS;i++){
+        acc += h->bucket[i];
+        if(acc > target){
+            return lat_bucket_value(i);
+        }
+    }
+    return h->max;
+}
+
+struct counters {
+    uint64_t connects;
+    uint64_t closes;
+    uint64_t messages;
+    uint64_t bytes;
+    uint64_t errors;
+    uint64_t table_full; /* MSCK_ERROR_MAX_SESSION */
+    uint64_t budget_hits; /* Read budget throttles */
+};
+
+static uint64_t
+now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Step, blocking for backend events at most until deadline (ns), so
+ * the periodic report keeps running when traffic stops */
+static void
+step_until(msck_ctx_t* ctx, uint64_t deadline){
+    struct pollfd pfd;
+    uint64_t now;
+    int timeout;
+    int t;
+    now = now_ns();
+    timeout = (deadline > now) ? (int)((deadline - now + 999999) / 1000000) : 0;
+    t = msck_ctx_backend_timeout(ctx);
+    if(t >= 0 && t < timeout){
+        timeout = t;
+    }
+    pfd.fd = msck_ctx_backend_fd(ctx);
+    if(pfd.fd < 0){
+        /* No pollable backend; may block past deadline */
+        msck_ctx_step(ctx, timeout > 0);
+        return;
+    }
+    if(timeout > 0){
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        (void)poll(&pfd, 1, timeout);
+    }
+    msck_ctx_step(ctx, 0);
+}
+
+static double
+rss_mb(void){
+    FILE* fp;
+    long pages;
+    long rss;
+    struct rusage ru;
+    fp = fopen("/proc/self/statm", "r");
+    if(fp){
+        if(fscanf(fp, "%ld %ld", &pages, &rss) == 2){
+            fclose(fp);
+            return (double)rss * sysconf(_SC_PAGESIZE) / (1024.0*1024.0);
+        }
+        fclose(fp);
+    }
+    /* Fallback: peak RSS */
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss / 1024.0;
+}
+
+static void
+raise_fd_limit(void){
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl)){
+        return;
+    }
+    rl.rlim_cur = rl.rlim_max;
+    if(setrlimit(RLIMIT_NOFILE, &rl)){
+        perror("setrlimit");
+    }
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < TABLE_SIZE){
+        fprintf(stderr, "warning: RLIMIT_NOFILE is %lu\n",
+                (unsigned long)rl.rlim_cur);
+    }
+}
+
+static uint64_t
+budget_hits_since(msck_ctx_t* ctx, uint64_t* last){
+    msck_ctx_stats_t st;
+    uint64_t total;
+    uint64_t delta;
+    msck_ctx_get_stats(ctx, &st);
+    total = st.budget_read_hits + st.budget_byte_hits;
+    delta = total - *last;
+    *last = total;
+    return delta;
+}
+
+static void
+report(const char* mode, double t, int open, const struct counters* c,
+       const struct lat_hist* h){
+    printf("%s t=%6.1fs open=%d/%d (%5.1f%%) conn/s=%llu close/s=%llu "
+           "msg/s=%llu MB/s=%.1f ",
+           mode, t, open, TABLE_SIZE, 100.0 * open / TABLE_SIZE,
+           (unsigned long long)c->connects,
+           (unsigned long long)c->closes,
+           (unsigned long long)c->messages,
+           c->bytes / (1024.0*1024.0));
+    if(h){
+        printf("lat_us p50=%llu p90=%llu p99=%llu p999=%llu max=%llu ",
+               (unsigned long long)lat_percentile(h, 50.0),
+               (unsigned long long)lat_percentile(h, 90.0),
+               (unsigned long long)lat_percentile(h, 99.0),
+               (unsigned long long)lat_percentile(h, 99.9),
+               (unsigned long long)h->max);
+    }
+    printf("err=%llu full=%llu budget=%llu rss=%.1fMB\n",
+           (unsigned long long)c->errors,
+           (unsigned long long)c->table_full,
+           (unsigned long long)c->budget_hits,
+           rss_mb());
+    fflush(stdout);
+}
+
+/*
+ * Options
+ */
+
+struct options {
+    int server;
+    unsigned char addr[4];
+    int port;
+    int nports;
+    int conns;
+    int connect_rate;
+    int close_rate;
+    int msg_sizes[MAX_MSG_SIZES];
+    int msg_nsizes;
+    int think_ms;
+    int duration;
+    int budget_reads;
+    long budget_bytes;
+};
+
+static struct options opt;
+
+static int
+parse_sizes(const char* arg){
+    const char* p;
+    char* e;
+    long v;
+    opt.msg_nsizes = 0;
+    p = arg;
+    while(*p){
+        if(opt.msg_nsizes == MAX_MSG_SIZES){
+            return 1;
+        }
+        v = strtol(p, &e, 10);
+        if(e == p || v < 0 || v > 1024*1024){
+            return 1;
+        }
+        opt.msg_sizes[opt.msg_nsizes++] = (int)v;
+        p = e;
+        if(*p == ','){
+            p++;
+        }else if(*p){
+            return 1;
+        }
+    }
+    return opt.msg_nsizes == 0;
+}
+
+static void
+usage(void){
+    fprintf(stderr,
+            "usage: msck-loadgen server [-p port] [-P nports] "
+            "[-b reads,bytes]\n"
+            "       msck-loadgen client [-a addr] [-p port] [-P nports] "
+            "[-c conns]\n"
+            "                           [-r connects/sec] [-k closes/sec] "
+            "[-m size,...]\n"
+            "                           [-i think-ms] [-d seconds] "
+            "[-b reads,bytes]\n");
+    exit(1);
+}
+
+static void
+parse_options(int ac, char** av){
+    int c;
+    if(ac < 2){
+        usage();
+    }
+    if(! strcmp(av[1], "server")){
+        opt.server = 1;
+    }else if(! strcmp(av[1], "client")){
+        opt.server = 0;
+    }else{
+        usage();
+    }
+    inet_pton(AF_INET, "127.0.0.1", opt.addr);
+    opt.port = 5000;
+    opt.nports = 1;
+    opt.conns = 10000;
+    opt.connect_rate = 0;
+    opt.close_rate = 0;
+    opt.msg_sizes[0] = 64;
+    opt.msg_nsizes = 1;
+    opt.think_ms = 0;
+    opt.duration = 10;
+    opt.budget_reads = 0;
+    opt.budget_bytes = 0;
+
+    optind = 2;
+    while((c = getopt(ac, av, "a:p:P:c:r:k:m:i:d:b:")) != -1){
+        switch(c){
+            case 'a':
+                if(inet_pton(AF_INET, optarg, opt.addr) != 1){
+                    usage();
+                }
+                break;
+            case 'p':
+                opt.port = atoi(optarg);
+                break;
+            case 'P':
+                opt.nports = atoi(optarg);
+                break;
+            case 'c':
+                opt.conns = atoi(optarg);
+                break;
+            case 'r':
+                opt.connect_rate = atoi(optarg);
+                break;
+            case 'k':
+                opt.close_rate = atoi(optarg);
+                break;
+            case 'm':
+                if(parse_sizes(optarg)){
+                    usage();
+                }
+                break;
+            case 'i':
+                opt.think_ms = atoi(optarg);
+                break;
+            case 'd':
+                opt.duration = atoi(optarg);
+                break;
+            case 'b':
+                if(sscanf(optarg, "%d,%ld", &opt.budget_reads,
+                          &opt.budget_bytes) != 2
+                   || opt.budget_reads < 0 || opt.budget_bytes < 0){
+                    usage();
+                }
+                break;
+            default:
+                usage();
+                break;
+        }
+    }
+    if(opt.nports < 1 || opt.port < 1 || opt.port + opt.nports > 65536
+       || opt.conns < 1 || opt.conns > TABLE_SIZE){
+        usage();
+    }
+}
+
+/*
+ * Server (echo)
+ */
+
+struct srv_session {
+    int listener;
+    int busy; /* Write in flight */
+};
+
+static struct srv_session srv_listener = { 1, 0 };
+static struct counters srv_stat;
+static int srv_open;
+static char srv_buf[RECV_BUF_SIZE];
+
+static void
+server_echo(msck_ctx_t* ctx, msck_session_t* session,
+            struct srv_session* ss){
+    size_t len;
+    size_t out;
+    int r;
+    if(ss->busy){
+        /* Leave data queued until SEND_RESULT */
+        return;
+    }
+    r = msck_session_read(ctx, session, srv_buf, sizeof(srv_buf), &len);
+    if(r || ! len){
+        return;
+    }
+    r = msck_session_write(ctx, session, srv_buf, len, &out);
+    if(r){
+        srv_stat.errors++;
+        return;
+    }
+    ss->busy = 1;
+    srv_stat.messages++;
+    srv_stat.bytes += len;
+}
+
+static void
+server_cb(msck_ctx_t* ctx, msck_event_t type, msck_error_t err,
+          msck_session_t* session, const char* buf, uintptr_t arg0,
+          uintptr_t data_ctx, uintptr_t data_session){
+    msck_session_t* s2;
+    struct srv_session* ss;
+    struct srv_session* ss2;
+    int r;
+    ss = (struct srv_session*)data_session;
+    switch(type){
+        case MSCK_EVENT_TYPE_SESSION_INCOMING:
+            if(ss->listener){
+                ss2 = calloc(1, sizeof(struct srv_session));
+                if(! ss2){
+                    srv_stat.errors++;
+                    break;
+                }
+                /* On failure the pending connection is dropped */
+                r = msck_session_accept(ctx, session, (uintptr_t)ss2, &s2);
+                if(r){
+                    free(ss2);
+                    if(r == MSCK_ERROR_MAX_SESSION){
+                        srv_stat.table_full++;
+                    }else{
+                        srv_stat.errors++;
+                    }
+                }else{
+                    srv_stat.connects++;
+                    srv_open++;
+                }
+            }else{
+                server_echo(ctx, session, ss);
+            }
+            break;
+        case MSCK_EVENT_TYPE_SESSION_SEND_RESULT:
+            ss->busy = 0;
+            if(err){
+                srv_stat.errors++;
+                break;
+            }
+            server_echo(ctx, session, ss);
+            break;
+        case MSCK_EVENT_TYPE_SESSION_TERMINATE:
+            if(! ss->listener){
+                /* Peer closed (or reset) */
+                srv_stat.closes++;
+                srv_open--;
+                free(ss);
+            }else{
+                srv_stat.errors++;
+            }
+            msck_session_destroy(ctx, session);
+            break;
+        case MSCK_EVENT_TYPE_SESSION_CREATE_RESULT:
+            if(err){
+                fprintf(stderr, "listen failed (%d, %ld)\n", (int)err,
+                        (long)arg0);
+                exit(1);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static int
+run_server(void){
+    msck_ctx_t* ctx;
+    msck_session_t* s;
+    uint64_t start, next;
+    uint64_t hits;
+    unsigned char any[4];
+    int i;
+    int r;
+
+    memset(any, 0, sizeof(any));
+    msck_ctx_create_default(server_cb, 0, &ctx);
+    msck_ctx_set_read_budget(ctx, opt.budget_reads, opt.budget_bytes);
+    hits = 0;
+    for(i=0;i!=opt.nports;i++){
+        r = msck_session_create(ctx, MSCK_SESSION_TYPE_STREAM_SERVER,
+                                MSCK_NAME_TYPE_IPV4, (const char*)any, 4,
+                                opt.port + i, 0,
+                                (uintptr_t)&srv_listener, &s);
+        if(r){
+            fprintf(stderr, "listen on %d failed (%d)\n", opt.port + i, r);
+            return 1;
+        }
+    }
+    printf("server: echo on ports %d-%d\n", opt.port,
+           opt.port + opt.nports - 1);
+
+    start = now_ns();
+    next = start + 1000000000ULL;
+    for(;;){
+        step_until(ctx, next);
+        if(now_ns() >= next){
+            srv_stat.budget_hits = budget_hits_since(ctx, &hits);
+            report("server", (next - start) / 1e9, srv_open, &srv_stat, 0);
+            memset(&srv_stat, 0, sizeof(srv_stat));
+            next += 1000000000ULL;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Client
+ */
+
+enum conn_state {
+    CONN_CLOSED,
+    CONN_CONNECTING,
+    CONN_THINKING,
+    CONN_WAIT_ECHO
+};
+
+struct conn {
+    msck_session_t* session;
+    enum conn_state state;
+    int send_pending; /* Write returned MSCK_ERROR_BUSY */
+    size_t expect;
+    size_t received;
+    uint64_t sent_at;
+};
+
+static struct conn* conns;
+static char* msg_buf;
+static char recv_buf[RECV_BUF_SIZE];
+
+/* Connections waiting to be (re)opened */
+static int* open_queue;
+static int open_head, open_tail, open_count;
+
+/* Connections in think time; FIFO since think time is constant */
+struct think_entry {
+    int idx;
+    uint64_t due;
+};
+static struct think_entry* think_queue;
+static int think_head, think_tail, think_count;
+
+static struct counters cli_stat;
+static struct lat_hist cli_lat;
+static struct lat_hist cli_lat_total;
+static int cli_open;
+static int cli_inflight;
+static unsigned int msg_next;
+
+static void
+open_push(int idx){
+    open_queue[open_tail] = idx;
+    open_tail = (open_tail + 1) % opt.conns;
+    open_count++;
+}
+
+static int
+open_pop(void){
+    int idx;
+    idx = open_queue[open_head];
+    open_head = (open_head + 1) % opt.conns;
+    open_count--;
+    return idx;
+}
+
+static void
+conn_close(msck_ctx_t* ctx, int idx, int failed){
+    struct conn* c;
+    c = &conns[idx];
+    if(c->state == CONN_CLOSED){
+        return;
+    }
+    if(c->state == CONN_WAIT_ECHO || c->state == CONN_CONNECTING){
+        cli_inflight--;
+    }
+    msck_session_destroy(ctx, c->session);
+    c->session = 0;
+    c->state = CONN_CLOSED;
+    cli_open--;
+    if(failed){
+        cli_stat.errors++;
+    }else{
+        cli_stat.closes++;
+    }
+    open_push(idx);
+}
+
+static void
+conn_send(msck_ctx_t* ctx, int idx){
+    struct conn* c;
+    size_t len;
+    size_t out;
+    int r;
+    c = &conns[idx];
+    len = opt.msg_sizes[msg_next++ % opt.msg_nsizes];
+    if(! len){
+        /* Connect-only mix entry */
+        c->state = CONN_THINKING;
+        if(opt.think_ms){
+            think_queue[think_tail].idx = idx;
+            think_queue[think_tail].due = now_ns()
+                + (uint64_t)opt.think_ms * 1000000ULL;
+            think_tail = (think_tail + 1) % opt.conns;
+            think_count++;
+        }
+        return;
+    }
+    c->expect = len;
+    c->received = 0;
+    c->sent_at = now_ns();
+    c->state = CONN_WAIT_ECHO;
+    cli_inflight++;
+    r = msck_session_write(ctx, c->session, msg_buf, len, &out);
+    if(r == MSCK_ERROR_BUSY){
+        c->send_pending = 1;
+    }else if(r){
+        conn_close(ctx, idx, 1);
+    }
+}
+
+static void
+conn_echo_done(msck_ctx_t* ctx, int idx){
+    struct conn* c;
+    c = &conns[idx];
+    lat_add(&cli_lat, (now_ns() - c->sent_at) / 1000);
+    cli_stat.messages++;
+    cli_stat.bytes += c->expect;
+    cli_inflight--;
+    if(opt.think_ms){
+        c->state = CONN_THINKING;
+        think_queue[think_tail].idx = idx;
+        think_queue[think_tail].due = now_ns()
+            + (uint64_t)opt.think_ms * 1000000ULL;
+        think_tail = (think_tail + 1) % opt.conns;
+        think_count++;
+    }else{
+        conn_send(ctx, idx);
+    }
+}
+
+static void
+client_cb(msck_ctx_t* ctx, msck_event_t type, msck_error_t err,
+          msck_session_t* session, const char* buf, uintptr_t arg0,
+          uintptr_t data_ctx, uintptr_t data_session){
+    int idx;
+    struct conn* c;
+    size_t len;
+    size_t out;
+    int r;
+    idx = (int)data_session;
+    c = &conns[idx];
+    if(c->session != session){
+        /* Stale event for a destroyed session */
+        return;
+    }
+    switch(type){
+        case MSCK_EVENT_TYPE_SESSION_CREATE_RESULT:
+            if(err){
+                conn_close(ctx, idx, 1);
+                break;
+            }
+            cli_inflight--;
+            cli_stat.connects++;
+            conn_send(ctx, idx);
+            break;
+        case MSCK_EVENT_TYPE_SESSION_SEND_RESULT:
+            if(err){
+                conn_close(ctx, idx, 1);
+                break;
+            }
+            if(c->send_pending){
+                c->send_pending = 0;
+                r = msck_session_write(ctx, session, msg_buf, c->expect,
+                                       &out);
+                if(r == MSCK_ERROR_BUSY){
+                    c->send_pending = 1;
+                }else if(r){
+                    conn_close(ctx, idx, 1);
+                }
+            }
+            break;
+        case MSCK_EVENT_TYPE_SESSION_INCOMING:
+            for(;;){
+                r = msck_session_read(ctx, session, recv_buf,
+                                      sizeof(recv_buf), &len);
+                if(r || ! len){
+                    break;
+                }
+                c->received += len;
+                if(c->state == CONN_WAIT_ECHO && c->received >= c->expect){
+                    conn_echo_done(ctx, idx);
+                    if(c->state != CONN_WAIT_ECHO){
+                        break;
+                    }
+                }
+            }
+            break;
+        case MSCK_EVENT_TYPE_SESSION_TERMINATE:
+            conn_close(ctx, idx, 1);
+            break;
+        default:
+            break;
+    }
+}
+
+static void
+client_open(msck_ctx_t* ctx, int idx){
+    struct conn* c;
+    int r;
+    c = &conns[idx];
+    r = msck_session_create(ctx, MSCK_SESSION_TYPE_STREAM,
+                            MSCK_NAME_TYPE_IPV4, (const char*)opt.addr, 4,
+                            opt.port + (idx % opt.nports), 0,
+                            (uintptr_t)idx, &c->session);
+    if(r){
+        if(r == MSCK_ERROR_MAX_SESSION){
+            cli_stat.table_full++;
+        }else{
+            cli_stat.errors++;
+        }
+        c->session = 0;
+        open_push(idx);
+        return;
+    }
+    c->state = CONN_CONNECTING;
+    c->send_pending = 0;
+    cli_open++;
+    cli_inflight++;
+}
+
+static int
+run_client(void){
+    msck_ctx_t* ctx;
+    uint64_t start, now, next, end, last;
+    uint64_t hits;
+    double connect_budget, close_budget;
+    int maxlen;
+    int i;
+    int n;
+    int idx;
+
+    conns = calloc(opt.conns, sizeof(struct conn));
+    open_queue = malloc(sizeof(int) * opt.conns);
+    think_queue = malloc(sizeof(struct think_entry) * opt.conns);
+    maxlen = 1;
+    for(i=0;i!=opt.msg_nsizes;i++){
+        if(opt.msg_sizes[i] > maxlen){
+            maxlen = opt.msg_sizes[i];
+        }
+    }
+    msg_buf = malloc(maxlen);
+    if(! conns || ! open_queue || ! think_queue || ! msg_buf){
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    memset(msg_buf, 'x', maxlen);
+    for(i=0;i!=opt.conns;i++){
+        open_push(i);
+    }
+    srand((unsigned int)now_ns());
+    msck_ctx_create_default(client_cb, 0, &ctx);
+    msck_ctx_set_read_budget(ctx, opt.budget_reads, opt.budget_bytes);
+    hits = 0;
+
+    start = now_ns();
+    last = start;
+    next = start + 1000000000ULL;
+    end = start + (uint64_t)opt.duration * 1000000000ULL;
+    connect_budget = 0;
+    close_budget = 0;
+    for(;;){
+        now = now_ns();
+        if(now >= next){
+            cli_stat.budget_hits = budget_hits_since(ctx, &hits);
+            report("client", (next - start) / 1e9, cli_open, &cli_stat,
+                   &cli_lat);
+            lat_merge(&cli_lat_total, &cli_lat);
+            memset(&cli_stat, 0, sizeof(cli_stat));
+            memset(&cli_lat, 0, sizeof(cli_lat));
+            next += 1000000000ULL;
+        }
+        if(now >= end){
+            break;
+        }
+
+        /* Ramp up / reopen */
+        if(opt.connect_rate){
+            connect_budget += opt.connect_rate * ((now - last) / 1e9);
+            if(connect_budget > opt.connect_rate){
+                connect_budget = opt.connect_rate;
+            }
+        }else{
+            connect_budget = opt.conns;
+        }
+        while(open_count && connect_budget >= 1.0){
+            n = open_count;
+            client_open(ctx, open_pop());
+            connect_budget -= 1.0;
+            if(open_count == n){
+                /* Pushed back: session table is full */
+                break;
+            }
+        }
+
+        /* Churn */
+        if(opt.close_rate){
+            close_budget += opt.close_rate * ((now - last) / 1e9);
+            while(close_budget >= 1.0){
+                close_budget -= 1.0;
+                idx = rand() % opt.conns;
+                if(conns[idx].state == CONN_THINKING
+                   || conns[idx].state == CONN_WAIT_ECHO){
+                    conn_close(ctx, idx, 0);
+                }
+            }
+        }
+        last = now;
+
+        /* Think time expiry */
+        while(think_count && think_queue[think_head].due <= now){
+            idx = think_queue[think_head].idx;
+            think_head = (think_head + 1) % opt.conns;
+            think_count--;
+            if(conns[idx].state == CONN_THINKING){
+                conn_send(ctx, idx);
+            }
+        }
+
+        /* Only block when something will wake us up */
+        if(cli_inflight > 0 && ! think_count && ! open_count){
+            step_until(ctx, (next < end) ? next : end);
+        }else{
+            msck_ctx_step(ctx, 0);
+        }
+    }
+    lat_merge(&cli_lat_total, &cli_lat);
+    printf("total: messages=%llu lat_us p50=%llu p90=%llu p99=%llu "
+           "p999=%llu max=%llu\n",
+           (unsigned long long)cli_lat_total.count,
+           (unsigned long long)lat_percentile(&cli_lat_total, 50.0),
+           (unsigned long long)lat_percentile(&cli_lat_total, 90.0),
+           (unsigned long long)lat_percentile(&cli_lat_total, 99.0),
+           (unsigned long long)lat_percentile(&cli_lat_total, 99.9),
+           (unsigned long long)cli_lat_total.max);
+    return 0;
+}
+
+int
+main(int ac, char** av){
+    parse_options(ac, av);
+    raise_fd_limit();
+    /* Writes to churned peers must fail with EPIPE, not kill us */
+    signal(SIGPIPE, SIG_IGN);
+    if(opt.server){
+        return run_server();
+    }else{
+        return run_client();
+    }
+}